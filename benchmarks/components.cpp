@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "BodyStore.hpp"
+#include "FakeFetchBackend.hpp"
+#include "URLFetcherServer.hpp"
+
+using urlfetcher::Response;
+using urlfetcher::server::FakeFetchBackend;
+using urlfetcher::server::FetchQueue;
+using urlfetcher::server::FetchShard;
+using urlfetcher::server::HashingBody;
+using urlfetcher::server::QueuedFetch;
+using urlfetcher::server::curl_response_to_hashing_body;
+using urlfetcher::server::curl_response_to_std_string;
+using urlfetcher::server::uint64;
+
+// Completed fetches written and resolved per benchmark iteration
+constexpr int COMPLETED_FETCHES_PER_ROUND{10'000};
+// Bytes passed to the cURL callbacks per benchmark iteration
+constexpr size_t CURL_BODY_BYTES{1024 * 1024};
+const int max_num_cores = std::max(1u, std::thread::hardware_concurrency());
+const std::string typical_url{"http://localhost:8000/echo/1234567890"};
+
+
+namespace urlfetcher::server {
+
+// Stages of a FetchShard that are private to it, exposed for these benchmarks only
+struct FetchShardStages {
+    static uint64 create_uuid(FetchShard& shard) {
+        return shard.create_uuid();
+    }
+
+    static void write_completed_fetch(FetchShard& shard, uint64 key, Response&& response) {
+        shard.write_completed_fetch(key, std::move(response));
+    }
+};
+
+} // namespace urlfetcher::server
+
+using urlfetcher::server::FetchShardStages;
+
+
+// Shard without fetcher threads, the benchmarks stand in for them
+FetchShard& idle_shard() {
+    static FetchShard shard(0, 0, 0, FakeFetchBackend());
+    return shard;
+}
+
+
+// One enqueue and one dequeue per iteration and thread on a queue shared by all threads,
+// as submit_fetch and the fetcher threads of a shard do
+void BM_FetchQueue(benchmark::State& state) {
+    static FetchQueue fetch_queue;
+    auto timeout = std::chrono::milliseconds(urlfetcher::server::FETCHER_THREAD_WAIT_ON_EMPTY_MS);
+    uint64 key{0};
+    QueuedFetch queued;
+    for (auto _ : state) {
+        fetch_queue.enqueue({++key, typical_url});
+        benchmark::DoNotOptimize(fetch_queue.wait_dequeue_timed(queued, timeout));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchQueue)->ThreadRange(1, max_num_cores)->UseRealTime();
+
+// Enqueue a whole batch at once, as submit_fetches does, then dequeue it one URL at a time
+void BM_FetchQueueBulk(benchmark::State& state) {
+    FetchQueue fetch_queue;
+    auto timeout = std::chrono::milliseconds(urlfetcher::server::FETCHER_THREAD_WAIT_ON_EMPTY_MS);
+    size_t batch_size = state.range(0);
+    QueuedFetch queued;
+    for (auto _ : state) {
+        std::vector<QueuedFetch> batch(batch_size, {0, typical_url});
+        fetch_queue.enqueue_bulk(std::make_move_iterator(batch.begin()), batch.size());
+        for (size_t i = 0; i < batch_size; ++i) {
+            benchmark::DoNotOptimize(fetch_queue.wait_dequeue_timed(queued, timeout));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_FetchQueueBulk)->RangeMultiplier(8)->Range(8, 4096);
+
+
+// N producer threads write completed fetches, as the fetcher threads do,
+// while M consumer threads resolve them, as ResolveFetch streams do
+void BM_CompletedFetches(benchmark::State& state) {
+    int num_producers = state.range(0);
+    int num_consumers = state.range(1);
+    FetchShard& shard = idle_shard();
+    FakeFetchBackend fetch;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::vector<uint64> keys(COMPLETED_FETCHES_PER_ROUND);
+        std::vector<Response> responses(COMPLETED_FETCHES_PER_ROUND);
+        for (int i = 0; i < keys.size(); ++i) {
+            keys[i] = FetchShardStages::create_uuid(shard);
+            responses[i] = fetch("http://localhost/echo/" + std::to_string(keys[i]));
+        }
+        state.ResumeTiming();
+        std::vector<std::thread> threads;
+        for (int p = 0; p < num_producers; ++p) {
+            threads.emplace_back([&, p] {
+                for (int i = p; i < keys.size(); i += num_producers) {
+                    FetchShardStages::write_completed_fetch(shard, keys[i], std::move(responses[i]));
+                }
+            });
+        }
+        for (int c = 0; c < num_consumers; ++c) {
+            threads.emplace_back([&, c] {
+                Response response;
+                for (int i = c; i < keys.size(); i += num_consumers) {
+                    shard.resolve_fetch(keys[i], &response);
+                    benchmark::DoNotOptimize(response);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * COMPLETED_FETCHES_PER_ROUND);
+}
+BENCHMARK(BM_CompletedFetches)
+    ->ArgsProduct({{1, 2, 8}, {1, 2, 8}})
+    ->ArgNames({"producers", "consumers"})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+
+// Build a successful Response from the header and body strings received by cURL, body size as argument
+void BM_ResponseConstruction(benchmark::State& state) {
+    FakeFetchBackend fetch(state.range(0));
+    Response fetched = fetch(typical_url);
+    for (auto _ : state) {
+        Response response;
+        response.set_header(fetched.header());
+        response.set_body(fetched.body());
+        response.set_body_digest(fetched.body_digest());
+        response.set_curl_error(CURLE_OK);
+        benchmark::DoNotOptimize(response);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ResponseConstruction)->RangeMultiplier(16)->Range(64, 4 << 20);
+
+// Serialize a Response as gRPC does before writing it to a ResolveFetch stream, body size as argument
+void BM_ResponseSerialization(benchmark::State& state) {
+    FakeFetchBackend fetch(state.range(0));
+    Response response = fetch(typical_url);
+    std::string serialized;
+    for (auto _ : state) {
+        response.SerializeToString(&serialized);
+        benchmark::DoNotOptimize(serialized);
+    }
+    state.SetBytesProcessed(state.iterations() * serialized.size());
+}
+BENCHMARK(BM_ResponseSerialization)->RangeMultiplier(16)->Range(64, 4 << 20);
+
+
+// Feed CURL_BODY_BYTES to the header callback in chunks, chunk size as argument.
+// cURL passes at most CURL_MAX_WRITE_SIZE bytes per call.
+void BM_CurlResponseToStdString(benchmark::State& state) {
+    std::string chunk(state.range(0), 'x');
+    for (auto _ : state) {
+        std::string received;
+        for (size_t size = 0; size < CURL_BODY_BYTES; size += chunk.size()) {
+            curl_response_to_std_string(chunk.data(), 1, chunk.size(), &received);
+        }
+        benchmark::DoNotOptimize(received);
+    }
+    state.SetBytesProcessed(state.iterations() * CURL_BODY_BYTES);
+}
+BENCHMARK(BM_CurlResponseToStdString)->RangeMultiplier(4)->Range(256, CURL_MAX_WRITE_SIZE);
+
+// Same as above for the body callback, which also hashes the body
+void BM_CurlResponseToHashingBody(benchmark::State& state) {
+    std::string chunk(state.range(0), 'x');
+    for (auto _ : state) {
+        HashingBody received;
+        for (size_t size = 0; size < CURL_BODY_BYTES; size += chunk.size()) {
+            curl_response_to_hashing_body(chunk.data(), 1, chunk.size(), &received);
+        }
+        benchmark::DoNotOptimize(received.hasher.digest());
+    }
+    state.SetBytesProcessed(state.iterations() * CURL_BODY_BYTES);
+}
+BENCHMARK(BM_CurlResponseToHashingBody)->RangeMultiplier(4)->Range(256, CURL_MAX_WRITE_SIZE);
+
+
+// Key creation, contended between threads calling submit_fetch on the same shard
+void BM_CreateUUID(benchmark::State& state) {
+    FetchShard& shard = idle_shard();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(FetchShardStages::create_uuid(shard));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateUUID)->ThreadRange(1, max_num_cores)->UseRealTime();
+
+
+int main(int argc, char** argv) {
+    urlfetcher::server::logger->set_level(spdlog::level::warn);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "FakeFetchBackend.hpp"
+#include "URLFetcherClient.hpp"
+#include "URLFetcherServer.hpp"
+
+using urlfetcher::Response;
+using urlfetcher::client::URLFetcherClient;
+using urlfetcher::server::FakeFetchBackend;
+using urlfetcher::server::FetchShard;
+using urlfetcher::server::ServerOptions;
+using urlfetcher::server::URLFetcherService;
+using urlfetcher::server::uint64;
+
+constexpr int FETCHES_PER_CLIENT{10'000};
+constexpr int URLS_PER_GRPC_ROUND_TRIP{10'000};
+constexpr int URLS_PER_REPLICA_ROUND_TRIP{4'000};
+constexpr int MAX_NUM_BENCHMARK_REPLICAS{8};
+// Every fake fetch of the replica benchmark takes this long, so that one replica is limited by its fetcher threads
+constexpr std::chrono::microseconds REPLICA_FETCH_LATENCY{1000};
+constexpr int REPLICA_FETCHER_THREADS{4};
+const int max_num_cores = std::max(1u, std::thread::hardware_concurrency());
+
+
+// Each client submits and resolves its fetches through one shard, like a RequestFetch and ResolveFetch stream pair
+void run_clients(URLFetcherService& service, int num_clients) {
+    std::vector<std::thread> clients;
+    for (int c = 0; c < num_clients; ++c) {
+        clients.emplace_back([&service, c] {
+            FetchShard& shard = service.shard(c % service.num_shards());
+            std::vector<uint64> keys(FETCHES_PER_CLIENT);
+            for (int i = 0; i < keys.size(); ++i) {
+                keys[i] = shard.submit_fetch("http://localhost/echo/" + std::to_string(i));
+            }
+            Response response;
+            for (auto key : keys) {
+                shard.resolve_fetch(key, &response);
+                benchmark::DoNotOptimize(response);
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+}
+
+// N clients against N pinned shards with one fetcher thread each
+void BM_ShardedService(benchmark::State& state) {
+    int num_cores = state.range(0);
+    ServerOptions options;
+    options.num_shards = num_cores;
+    options.num_fetcher_threads = 1;
+    options.pin_threads = true;
+    options.fetch = FakeFetchBackend();
+    URLFetcherService service(options);
+    for (auto _ : state) {
+        run_clients(service, num_cores);
+    }
+    state.SetItemsProcessed(state.iterations() * num_cores * FETCHES_PER_CLIENT);
+}
+BENCHMARK(BM_ShardedService)->RangeMultiplier(2)->Range(1, max_num_cores)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Baseline: N clients against a single shard with N fetcher threads
+void BM_SingleShardService(benchmark::State& state) {
+    int num_cores = state.range(0);
+    ServerOptions options;
+    options.num_shards = 1;
+    options.num_fetcher_threads = num_cores;
+    options.fetch = FakeFetchBackend();
+    URLFetcherService service(options);
+    for (auto _ : state) {
+        run_clients(service, num_cores);
+    }
+    state.SetItemsProcessed(state.iterations() * num_cores * FETCHES_PER_CLIENT);
+}
+BENCHMARK(BM_SingleShardService)->RangeMultiplier(2)->Range(1, max_num_cores)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+// URLFetcherService with fake fetches behind a gRPC server on a free localhost port
+class InProcessServer final {
+public:
+    explicit InProcessServer(const ServerOptions& options = fake_fetch_options()) : service_(options) {
+        grpc::ServerBuilder builder;
+        int port{0};
+        builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+        builder.RegisterService(&service_);
+        server_ = builder.BuildAndStart();
+        address_ = "localhost:" + std::to_string(port);
+    }
+    ~InProcessServer() {
+        server_->Shutdown();
+    }
+
+    const std::string& address() const {
+        return address_;
+    }
+
+    static ServerOptions fake_fetch_options() {
+        ServerOptions options;
+        options.fetch = FakeFetchBackend();
+        return options;
+    }
+
+private:
+
+    URLFetcherService service_;
+    std::unique_ptr<grpc::Server> server_;
+    std::string address_;
+};
+
+std::vector<std::string> small_urls(int num_urls) {
+    std::vector<std::string> urls(num_urls);
+    for (int i = 0; i < urls.size(); ++i) {
+        urls[i] = "http://localhost/echo/" + std::to_string(i);
+    }
+    return urls;
+}
+
+// Request and resolve small URLs with one message per URL
+void BM_SingleMessageStreams(benchmark::State& state) {
+    InProcessServer server;
+    URLFetcherClient fetcher(server.address());
+    auto urls = small_urls(URLS_PER_GRPC_ROUND_TRIP);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fetcher.resolve_fetches(fetcher.request_fetches(urls)));
+    }
+    state.SetItemsProcessed(state.iterations() * urls.size());
+}
+BENCHMARK(BM_SingleMessageStreams)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Request and resolve small URLs with RequestFetchBatch and ResolveFetchBatch, batch size as argument
+void BM_BatchStreams(benchmark::State& state) {
+    InProcessServer server;
+    URLFetcherClient fetcher(server.address());
+    auto urls = small_urls(URLS_PER_GRPC_ROUND_TRIP);
+    size_t batch_size = state.range(0);
+    for (auto _ : state) {
+        auto keys = fetcher.request_fetches_in_batches(urls, batch_size);
+        benchmark::DoNotOptimize(fetcher.resolve_fetches_in_batches(keys, batch_size));
+    }
+    state.SetItemsProcessed(state.iterations() * urls.size());
+}
+BENCHMARK(BM_BatchStreams)->RangeMultiplier(8)->Range(8, 4096)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// One client spreading batched fetches over N replicas, each with a few fetcher threads and a fixed fetch latency
+void BM_Replicas(benchmark::State& state) {
+    int num_replicas = state.range(0);
+    std::vector<std::unique_ptr<InProcessServer> > servers;
+    std::vector<std::string> addresses;
+    for (int replica_id = 0; replica_id < num_replicas; ++replica_id) {
+        ServerOptions options;
+        options.replica_id = replica_id;
+        options.num_fetcher_threads = REPLICA_FETCHER_THREADS;
+        options.fetch = FakeFetchBackend(0, REPLICA_FETCH_LATENCY);
+        servers.push_back(std::make_unique<InProcessServer>(options));
+        addresses.push_back(servers.back()->address());
+    }
+    URLFetcherClient fetcher(addresses);
+    auto urls = small_urls(URLS_PER_REPLICA_ROUND_TRIP);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fetcher.resolve_fetches_in_batches(fetcher.request_fetches_in_batches(urls)));
+    }
+    state.SetItemsProcessed(state.iterations() * urls.size());
+}
+BENCHMARK(BM_Replicas)->RangeMultiplier(2)->Range(1, MAX_NUM_BENCHMARK_REPLICAS)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+
+int main(int argc, char** argv) {
+    urlfetcher::server::logger->set_level(spdlog::level::warn);
+    urlfetcher::client::logger->set_level(spdlog::level::warn);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -0,0 +1,219 @@
+#ifndef INCLUDED_BODYSTORE_HPP
+#define INCLUDED_BODYSTORE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <google/protobuf/stubs/common.h>
+
+
+namespace urlfetcher::server {
+
+using google::protobuf::uint64;
+
+
+// Streaming XXH64, fed chunk by chunk from the cURL write callback so that the body is hashed while it is received.
+// The four independent accumulator lanes over 32 byte stripes have no dependencies between them,
+// which lets the compiler keep all of them in flight (and vectorize them on targets with 64-bit SIMD multiplies).
+class BodyHasher final {
+public:
+    explicit BodyHasher(uint64 seed = 0)
+        : lanes_{seed + PRIME_1 + PRIME_2, seed + PRIME_2, seed, seed - PRIME_1}, seed_(seed) {
+    }
+
+    void update(const char* data, size_t size) {
+        const auto* input = reinterpret_cast<const unsigned char*>(data);
+        total_size_ += size;
+        // Complete a stripe left over from the previous chunk
+        if (buffered_ > 0) {
+            size_t fill = std::min(size, STRIPE_SIZE - buffered_);
+            std::memcpy(buffer_ + buffered_, input, fill);
+            buffered_ += fill;
+            input += fill;
+            size -= fill;
+            if (buffered_ < STRIPE_SIZE) {
+                return;
+            }
+            consume_stripe(buffer_);
+            buffered_ = 0;
+        }
+        for (; size >= STRIPE_SIZE; input += STRIPE_SIZE, size -= STRIPE_SIZE) {
+            consume_stripe(input);
+        }
+        if (size > 0) {
+            std::memcpy(buffer_, input, size);
+            buffered_ = size;
+        }
+    }
+
+    uint64 digest() const {
+        uint64 hash;
+        if (total_size_ >= STRIPE_SIZE) {
+            hash = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+            for (auto lane : lanes_) {
+                hash = merge_lane(hash, lane);
+            }
+        }
+        else {
+            hash = seed_ + PRIME_5;
+        }
+        hash += total_size_;
+        const unsigned char* tail = buffer_;
+        size_t size = buffered_;
+        for (; size >= 8; tail += 8, size -= 8) {
+            hash ^= round(0, read64(tail));
+            hash = rotl(hash, 27) * PRIME_1 + PRIME_4;
+        }
+        if (size >= 4) {
+            hash ^= static_cast<uint64>(read32(tail)) * PRIME_1;
+            hash = rotl(hash, 23) * PRIME_2 + PRIME_3;
+            tail += 4;
+            size -= 4;
+        }
+        for (; size > 0; ++tail, --size) {
+            hash ^= *tail * PRIME_5;
+            hash = rotl(hash, 11) * PRIME_1;
+        }
+        hash ^= hash >> 33;
+        hash *= PRIME_2;
+        hash ^= hash >> 29;
+        hash *= PRIME_3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    static uint64 digest_of(const std::string& data) {
+        BodyHasher hasher;
+        hasher.update(data.data(), data.size());
+        return hasher.digest();
+    }
+
+private:
+    static constexpr size_t STRIPE_SIZE{32};
+    static constexpr uint64 PRIME_1{11400714785074694791ULL};
+    static constexpr uint64 PRIME_2{14029467366897019727ULL};
+    static constexpr uint64 PRIME_3{1609587929392839161ULL};
+    static constexpr uint64 PRIME_4{9650029242287828579ULL};
+    static constexpr uint64 PRIME_5{2870177450012600261ULL};
+
+    static uint64 rotl(uint64 x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64 read64(const unsigned char* p) {
+        uint64 value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64 round(uint64 acc, uint64 input) {
+        acc += input * PRIME_2;
+        acc = rotl(acc, 31);
+        return acc * PRIME_1;
+    }
+
+    static uint64 merge_lane(uint64 hash, uint64 lane) {
+        hash ^= round(0, lane);
+        return hash * PRIME_1 + PRIME_4;
+    }
+
+    void consume_stripe(const unsigned char* stripe) {
+        lanes_[0] = round(lanes_[0], read64(stripe));
+        lanes_[1] = round(lanes_[1], read64(stripe + 8));
+        lanes_[2] = round(lanes_[2], read64(stripe + 16));
+        lanes_[3] = round(lanes_[3], read64(stripe + 24));
+    }
+
+    uint64 lanes_[4];
+    uint64 seed_;
+    uint64 total_size_{0};
+    unsigned char buffer_[STRIPE_SIZE];
+    size_t buffered_{0};
+};
+
+
+// cURL body sink that hashes the response body while appending it
+struct HashingBody {
+    std::string body;
+    BodyHasher hasher;
+};
+
+size_t curl_response_to_hashing_body(void* curl_response, size_t size, size_t nmemb, HashingBody* response) {
+    size_t response_size{size * nmemb};
+    const char* data = static_cast<char*>(curl_response);
+    response->hasher.update(data, response_size);
+    response->body.append(data, response_size);
+    return response_size;
+}
+
+
+// Content-addressed storage for response bodies.
+// Each distinct payload is kept once, keyed by its digest, and freed when the last completed fetch referring to it is popped.
+class BodyStore final {
+public:
+    // Store body under digest and take one reference to it.
+    // Returns false if a different payload with the same digest is already stored, in which case nothing is stored
+    // and the caller should keep its own copy of the body.
+    bool acquire(uint64 digest, std::string&& body) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        auto [item, inserted] = bodies_.try_emplace(digest);
+        auto& entry = item->second;
+        if (inserted) {
+            entry.body = std::move(body);
+        }
+        else if (entry.body != body) {
+            return false;
+        }
+        ++entry.references;
+        return true;
+    }
+
+    // Copy of the body stored under digest, which must be held by the caller
+    std::string get(uint64 digest) const {
+        std::unique_lock<std::mutex> guard(mutex_);
+        return bodies_.at(digest).body;
+    }
+
+    // Drop one reference to digest, freeing the body when no references are left
+    void release(uint64 digest) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        auto item = bodies_.find(digest);
+        if (item != bodies_.end() && --item->second.references == 0) {
+            bodies_.erase(item);
+        }
+    }
+
+    size_t num_bodies() const {
+        std::unique_lock<std::mutex> guard(mutex_);
+        return bodies_.size();
+    }
+
+    size_t num_references(uint64 digest) const {
+        std::unique_lock<std::mutex> guard(mutex_);
+        auto item = bodies_.find(digest);
+        return item == bodies_.end() ? 0 : item->second.references;
+    }
+
+private:
+    struct Entry {
+        std::string body;
+        size_t references{0};
+    };
+
+    std::unordered_map<uint64, Entry> bodies_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace urlfetcher::server
+
+#endif // INCLUDED_BODYSTORE_HPP
@@ -0,0 +1,295 @@
+#ifndef INCLUDED_BULKFETCH_HPP
+#define INCLUDED_BULKFETCH_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "URLFetcherClient.hpp"
+
+
+namespace urlfetcher::client {
+
+using urlfetcher::FetchRecord;
+
+// Total number of fetches kept outstanding by BulkFetcher, split evenly between the replicas
+constexpr size_t DEFAULT_BULK_FETCH_WINDOW{1000};
+
+
+// Latency histogram with a fixed number of log-linear buckets, so that recording any number of values takes constant memory.
+// Each power of two is split into 16 buckets, so percentiles are within 1/16 of the recorded values.
+class LatencyHistogram final {
+public:
+    void record(uint64 value) {
+        ++counts_[bucket_of(value)];
+        ++count_;
+        max_ = std::max(max_, value);
+    }
+
+    uint64 count() const {
+        return count_;
+    }
+
+    uint64 max() const {
+        return max_;
+    }
+
+    // Upper bound of the bucket below which a fraction p of all recorded values lie
+    uint64 percentile(double p) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64 rank = std::max<uint64>(1, std::ceil(p * count_));
+        uint64 seen{0};
+        for (size_t bucket = 0; bucket < counts_.size(); ++bucket) {
+            seen += counts_[bucket];
+            if (seen >= rank) {
+                return std::min(max_, upper_bound_of(bucket));
+            }
+        }
+        return max_;
+    }
+
+private:
+    static constexpr int SUB_BUCKET_BITS{4};
+    static constexpr uint64 NUM_SUB_BUCKETS{1 << SUB_BUCKET_BITS};
+    // Values below NUM_SUB_BUCKETS get a bucket each, every higher power of two up to 2^63 gets NUM_SUB_BUCKETS
+    static constexpr size_t NUM_BUCKETS{(64 - SUB_BUCKET_BITS + 1) * NUM_SUB_BUCKETS};
+
+    static size_t bucket_of(uint64 value) {
+        if (value < NUM_SUB_BUCKETS) {
+            return value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BUCKET_BITS;
+        return (shift + 1) * NUM_SUB_BUCKETS + ((value >> shift) & (NUM_SUB_BUCKETS - 1));
+    }
+
+    static uint64 upper_bound_of(size_t bucket) {
+        if (bucket < NUM_SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / NUM_SUB_BUCKETS - 1;
+        uint64 sub_bucket = bucket % NUM_SUB_BUCKETS;
+        // Wraps around to the largest uint64 for the last bucket
+        return ((NUM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+    }
+
+    std::array<uint64, NUM_BUCKETS> counts_{};
+    uint64 count_{0};
+    uint64 max_{0};
+};
+
+
+struct BulkFetchSummary {
+    // Fetches resolved by the servers, including those that failed with a cURL error
+    uint64 num_resolved{0};
+    // Fetches that failed with a cURL error or were never resolved, e.g. because a stream broke
+    uint64 num_failed{0};
+    // Sum of the body sizes, or of the file sizes of downloads
+    uint64 body_bytes{0};
+    std::chrono::duration<double> elapsed{0};
+    // Microseconds from writing each URL to the server until its response was received
+    LatencyHistogram latencies_us;
+};
+
+
+// Fetches an unbounded stream of URLs with a fixed window of outstanding fetches, in constant memory.
+// Each replica gets one long-lived RequestFetch and ResolveFetch stream pair.
+// URLs are written to RequestFetch as soon as the window has room, the returned keys are forwarded to ResolveFetch
+// right away, and each response is handed over as soon as it arrives.
+// Replicas pull URLs from the shared input whenever their window has room, so faster replicas take more of them.
+class BulkFetcher final {
+public:
+    // Returns false when there are no more URLs
+    using URLSource = std::function<bool(std::string*)>;
+    // Called for each result in the order the responses arrive, which is the input order with a single replica.
+    // Never called concurrently.
+    using ResultSink = std::function<void(FetchRecord&)>;
+
+    // Each replica gets window / server_addresses.size() outstanding fetches, but at least one,
+    // so a window smaller than the number of replicas is exceeded
+    explicit BulkFetcher(
+            const std::vector<std::string>& server_addresses,
+            size_t window = DEFAULT_BULK_FETCH_WINDOW,
+            bool download_to_file = false)
+        : replica_window_(std::max<size_t>(1, window / std::max<size_t>(1, server_addresses.size()))),
+          download_to_file_(download_to_file) {
+        for (const auto& server_address : server_addresses) {
+            auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+            replicas_.push_back({server_address, URLFetcher::NewStub(channel)});
+        }
+    }
+
+    BulkFetchSummary run(URLSource next_url, ResultSink write_result) {
+        Input input{std::move(next_url)};
+        Output output{std::move(write_result)};
+        auto start = Clock::now();
+        std::vector<std::thread> pipelines;
+        for (auto& replica : replicas_) {
+            pipelines.emplace_back([&] { fetch_through(replica, input, output); });
+        }
+        for (auto& pipeline : pipelines) {
+            pipeline.join();
+        }
+        output.summary.elapsed = Clock::now() - start;
+        return output.summary;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Replica {
+        std::string address;
+        std::unique_ptr<URLFetcher::Stub> stub;
+    };
+
+    struct Input {
+        URLSource next_url;
+        uint64 next_index{0};
+        std::mutex mutex;
+    };
+
+    struct Output {
+        ResultSink write_result;
+        BulkFetchSummary summary;
+        std::mutex mutex;
+    };
+
+    struct InFlight {
+        uint64 index;
+        std::string url;
+        Clock::time_point requested;
+    };
+
+    // The URLs written to one replica and not yet resolved, in the order they were written
+    struct Window {
+        std::deque<InFlight> fetches;
+        bool closed{false};
+        std::mutex mutex;
+        std::condition_variable has_room;
+    };
+
+    void fetch_through(Replica& replica, Input& input, Output& output) {
+        logger->info("Streaming URLs to server '{:s}' with {:d} outstanding fetches", replica.address, replica_window_);
+        ClientContext request_context;
+        ClientContext resolve_context;
+        auto requests = replica.stub->RequestFetch(&request_context);
+        auto resolves = replica.stub->ResolveFetch(&resolve_context);
+        Window window;
+
+        std::thread requester([&] {
+            while (true) {
+                std::unique_lock<std::mutex> guard(window.mutex);
+                window.has_room.wait(guard, [&] { return window.closed || window.fetches.size() < replica_window_; });
+                if (window.closed) {
+                    break;
+                }
+                guard.unlock();
+                InFlight fetch;
+                {
+                    std::unique_lock<std::mutex> input_guard(input.mutex);
+                    if (!input.next_url(&fetch.url)) {
+                        break;
+                    }
+                    fetch.index = input.next_index++;
+                }
+                Request request;
+                request.set_url(fetch.url);
+                request.set_download_to_file(download_to_file_);
+                fetch.requested = Clock::now();
+                // Queued before writing, since the response may arrive before Write returns
+                guard.lock();
+                window.fetches.push_back(std::move(fetch));
+                guard.unlock();
+                if (!requests->Write(request)) {
+                    break;
+                }
+            }
+            requests->WritesDone();
+        });
+
+        // Forward every key to ResolveFetch as soon as it arrives, RequestFetch returns them in the order of the URLs
+        std::thread key_forwarder([&] {
+            PendingFetch pending_fetch;
+            while (requests->Read(&pending_fetch)) {
+                resolves->Write(pending_fetch);
+            }
+            resolves->WritesDone();
+        });
+
+        FetchRecord record;
+        while (resolves->Read(record.mutable_response())) {
+            InFlight fetch;
+            {
+                std::unique_lock<std::mutex> guard(window.mutex);
+                if (window.fetches.empty()) {
+                    logger->error("Server '{:s}' returned more responses than it was sent URLs", replica.address);
+                    break;
+                }
+                fetch = std::move(window.fetches.front());
+                window.fetches.pop_front();
+            }
+            window.has_room.notify_one();
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - fetch.requested);
+            record.set_index(fetch.index);
+            record.set_url(std::move(fetch.url));
+            record.set_latency_us(latency.count());
+            write(output, record);
+        }
+
+        size_t num_unresolved{0};
+        {
+            std::unique_lock<std::mutex> guard(window.mutex);
+            window.closed = true;
+            num_unresolved = window.fetches.size();
+        }
+        window.has_room.notify_one();
+        requester.join();
+        key_forwarder.join();
+        // Only after the requester is done writing and the key forwarder is done reading
+        Status status = requests->Finish();
+        if (!status.ok()) {
+            logger->error("RequestFetch to '{:s}' failed: {:s}", replica.address, status.error_message());
+        }
+        status = resolves->Finish();
+        if (!status.ok()) {
+            logger->error("ResolveFetch from '{:s}' failed: {:s}", replica.address, status.error_message());
+        }
+        if (num_unresolved > 0) {
+            logger->error("{:d} fetches sent to '{:s}' were not resolved", num_unresolved, replica.address);
+            std::unique_lock<std::mutex> guard(output.mutex);
+            output.summary.num_failed += num_unresolved;
+        }
+    }
+
+    static void write(Output& output, FetchRecord& record) {
+        const Response& response = record.response();
+        std::unique_lock<std::mutex> guard(output.mutex);
+        auto& summary = output.summary;
+        ++summary.num_resolved;
+        if (response.curl_error() != 0) {
+            ++summary.num_failed;
+        }
+        summary.body_bytes += response.file_path().empty() ? response.body().size() : response.file_size();
+        summary.latencies_us.record(record.latency_us());
+        output.write_result(record);
+    }
+
+    size_t replica_window_;
+    bool download_to_file_;
+    std::vector<Replica> replicas_;
+};
+
+} // namespace urlfetcher::client
+
+#endif // INCLUDED_BULKFETCH_HPP
@@ -0,0 +1,106 @@
+#ifndef INCLUDED_CPUTOPOLOGY_HPP
+#define INCLUDED_CPUTOPOLOGY_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+
+namespace urlfetcher::server {
+
+// Parse a Linux cpulist such as "0-3,8,10-11"
+std::vector<int> parse_cpulist(const std::string& cpulist) {
+    std::vector<int> cpus;
+    std::stringstream ranges(cpulist);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        auto dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// All CPUs this process may run on, ordered NUMA node by node.
+// Consecutive CPUs in the result are on the same node whenever possible,
+// so contiguous slices of it do not straddle nodes unless they have to.
+std::vector<int> numa_ordered_cpus() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+    std::vector<int> cpus;
+    for (int node = 0; ; ++node) {
+        std::ifstream cpulist_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!cpulist_file) {
+            break;
+        }
+        std::string cpulist;
+        std::getline(cpulist_file, cpulist);
+        for (int cpu : parse_cpulist(cpulist)) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    // No NUMA information available, treat the machine as a single node
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Split the NUMA ordered CPUs into num_parts contiguous, disjoint sets.
+// If there are fewer CPUs than parts, CPUs are shared round-robin.
+std::vector<std::vector<int>> partition_cpus(int num_parts) {
+    std::vector<int> cpus = numa_ordered_cpus();
+    std::vector<std::vector<int>> parts(num_parts);
+    if (cpus.empty()) {
+        return parts;
+    }
+    int num_cpus = cpus.size();
+    for (int part = 0; part < num_parts; ++part) {
+        if (num_cpus < num_parts) {
+            parts[part].push_back(cpus[part % num_cpus]);
+        }
+        else {
+            parts[part].assign(
+                    cpus.begin() + part * num_cpus / num_parts,
+                    cpus.begin() + (part + 1) * num_cpus / num_parts);
+        }
+    }
+    return parts;
+}
+
+bool pin_thread_to_cpus(std::thread& thread, const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &cpu_set);
+    }
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set), &cpu_set) == 0;
+}
+
+} // namespace urlfetcher::server
+
+#endif // INCLUDED_CPUTOPOLOGY_HPP
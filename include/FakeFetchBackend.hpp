@@ -0,0 +1,50 @@
+#ifndef INCLUDED_FAKEFETCHBACKEND_HPP
+#define INCLUDED_FAKEFETCHBACKEND_HPP
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <curl/curl.h>
+
+#include "BodyStore.hpp"
+#include "urlfetcher.grpc.pb.h"
+
+
+namespace urlfetcher::server {
+
+// In-process stand-in for fetch_URL, usable as ServerOptions::fetch, that never touches the network.
+// Like the echo server used by the tests, the body is the last path component of the URL,
+// padded with '.' or truncated to body_size bytes if body_size is not 0.
+// Each fetch takes at least latency, so runs against it are deterministic and work offline.
+class FakeFetchBackend final {
+public:
+    explicit FakeFetchBackend(size_t body_size = 0, std::chrono::microseconds latency = std::chrono::microseconds{0})
+        : body_size_(body_size), latency_(latency) {
+    }
+
+    urlfetcher::Response operator()(const std::string& url) const {
+        if (latency_.count() > 0) {
+            std::this_thread::sleep_for(latency_);
+        }
+        std::string body = url.substr(url.rfind('/') + 1);
+        if (body_size_ > 0) {
+            body.resize(body_size_, '.');
+        }
+        urlfetcher::Response response;
+        response.set_header("HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n");
+        response.set_body_digest(BodyHasher::digest_of(body));
+        response.set_body(std::move(body));
+        response.set_http_status(200);
+        response.set_curl_error(CURLE_OK);
+        return response;
+    }
+
+private:
+    size_t body_size_;
+    std::chrono::microseconds latency_;
+};
+
+} // namespace urlfetcher::server
+
+#endif // INCLUDED_FAKEFETCHBACKEND_HPP
@@ -0,0 +1,40 @@
+#ifndef INCLUDED_FETCHKEY_HPP
+#define INCLUDED_FETCHKEY_HPP
+
+#include <google/protobuf/stubs/common.h>
+
+
+namespace urlfetcher {
+
+using google::protobuf::uint64;
+
+// Keys of pending fetches are laid out as [8 bits replica id][8 bits shard index][48 bits per-shard sequence number]
+// so that both clients and servers can tell which replica and which shard own a key
+constexpr int KEY_SEQUENCE_BITS{48};
+constexpr int KEY_SHARD_BITS{8};
+constexpr int KEY_REPLICA_BITS{8};
+constexpr int MAX_NUM_SHARDS{1 << KEY_SHARD_BITS};
+constexpr int MAX_NUM_REPLICAS{1 << KEY_REPLICA_BITS};
+
+constexpr uint64 make_key(int shard_index, uint64 sequence, int replica_id = 0) {
+    return (static_cast<uint64>(replica_id) << (KEY_SEQUENCE_BITS + KEY_SHARD_BITS))
+        | (static_cast<uint64>(shard_index) << KEY_SEQUENCE_BITS)
+        | sequence;
+}
+
+constexpr int shard_of_key(uint64 key) {
+    return (key >> KEY_SEQUENCE_BITS) & (MAX_NUM_SHARDS - 1);
+}
+
+constexpr int replica_of_key(uint64 key) {
+    return (key >> (KEY_SEQUENCE_BITS + KEY_SHARD_BITS)) & (MAX_NUM_REPLICAS - 1);
+}
+
+// Sequence numbers start at 1, so no valid key has the sequence number 0, e.g. the key 0 clients use for failed requests
+constexpr bool is_valid_key(uint64 key) {
+    return (key & ((uint64{1} << KEY_SEQUENCE_BITS) - 1)) != 0;
+}
+
+} // namespace urlfetcher
+
+#endif // INCLUDED_FETCHKEY_HPP
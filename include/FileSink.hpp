@@ -0,0 +1,217 @@
+#ifndef INCLUDED_FILESINK_HPP
+#define INCLUDED_FILESINK_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <google/protobuf/stubs/common.h>
+
+
+namespace urlfetcher::server {
+
+using google::protobuf::uint64;
+
+// Alignment of buffers, offsets and sizes for O_DIRECT writes, a multiple of the logical block size of common devices
+constexpr size_t FILE_DIRECT_ALIGNMENT{4096};
+// Size of the aligned buffer that O_DIRECT writes are collected into
+constexpr size_t FILE_DIRECT_BUFFER_BYTES{1024 * 1024};
+// With FileSyncMode::sync_file_range, each chunk of this size is written back and dropped from the page cache
+constexpr uint64 FILE_SYNC_CHUNK_BYTES{8 * 1024 * 1024};
+
+
+enum class FileSyncMode {
+    // Buffered writes, left to the page cache
+    none,
+    // Buffered writes, but each finished chunk is written back with sync_file_range and then dropped from the page cache,
+    // so that a large download does not fill the page cache or end in one long writeback
+    sync_file_range,
+    // O_DIRECT writes from an aligned buffer, bypassing the page cache.
+    // Falls back to none if the file system does not support O_DIRECT.
+    direct,
+};
+
+
+// Write-only file that takes a body chunk by chunk, as cURL delivers it, with constant memory use
+class FileSink final {
+public:
+    FileSink(const std::string& path, FileSyncMode mode) : mode_(mode) {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (mode_ == FileSyncMode::direct) {
+            fd_ = open(path.c_str(), flags | O_DIRECT, 0644);
+            if (fd_ >= 0) {
+                buffer_.reset(static_cast<char*>(std::aligned_alloc(FILE_DIRECT_ALIGNMENT, FILE_DIRECT_BUFFER_BYTES)));
+            }
+            if (!buffer_) {
+                mode_ = FileSyncMode::none;
+                if (fd_ >= 0) {
+                    ::close(fd_);
+                }
+            }
+        }
+        if (mode_ != FileSyncMode::direct) {
+            fd_ = open(path.c_str(), flags, 0644);
+        }
+        if (fd_ < 0) {
+            error_ = errno;
+        }
+    }
+    ~FileSink() noexcept {
+        close();
+    }
+    FileSink (const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    bool is_open() const {
+        return fd_ >= 0;
+    }
+
+    // Mode actually used, which differs from the requested one if O_DIRECT was not supported
+    FileSyncMode mode() const {
+        return mode_;
+    }
+
+    // errno of the first call that failed, 0 if none did
+    int error() const {
+        return error_;
+    }
+
+    uint64 size() const {
+        return written_ + buffered_;
+    }
+
+    // Reserve size bytes on disk, e.g. from the Content-Length of the response, so that the file is laid out contiguously.
+    // Best effort, nothing happens if the file system does not support it.
+    void preallocate(uint64 size) {
+        if (is_open() && size > 0 && fallocate(fd_, 0, 0, size) == 0) {
+            preallocated_ = true;
+        }
+    }
+
+    bool write(const char* data, size_t size) {
+        if (!is_open()) {
+            return false;
+        }
+        if (mode_ != FileSyncMode::direct) {
+            return write_through(data, size);
+        }
+        while (size > 0) {
+            size_t fill = std::min(size, FILE_DIRECT_BUFFER_BYTES - buffered_);
+            std::memcpy(buffer_.get() + buffered_, data, fill);
+            buffered_ += fill;
+            data += fill;
+            size -= fill;
+            if (buffered_ == FILE_DIRECT_BUFFER_BYTES) {
+                if (!write_all(buffer_.get(), buffered_)) {
+                    return false;
+                }
+                buffered_ = 0;
+            }
+        }
+        return true;
+    }
+
+    // Write out what is left, trim any preallocated space beyond the end of the body and, unless the mode is none,
+    // wait until the data is on disk. Returns false if any write failed.
+    bool close() {
+        if (!is_open()) {
+            return error_ == 0;
+        }
+        if (buffered_ > 0) {
+            // The tail is not a multiple of the alignment, write it without O_DIRECT
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+            if (write_all(buffer_.get(), buffered_)) {
+                buffered_ = 0;
+            }
+        }
+        if (preallocated_ && ftruncate(fd_, written_) != 0) {
+            fail();
+        }
+        if (mode_ != FileSyncMode::none) {
+            if (fdatasync(fd_) != 0) {
+                fail();
+            }
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        if (::close(fd_) != 0) {
+            fail();
+        }
+        fd_ = -1;
+        return error_ == 0;
+    }
+
+private:
+    bool write_through(const char* data, size_t size) {
+        uint64 chunk_begin = written_ / FILE_SYNC_CHUNK_BYTES * FILE_SYNC_CHUNK_BYTES;
+        if (!write_all(data, size)) {
+            return false;
+        }
+        if (mode_ == FileSyncMode::sync_file_range) {
+            // Start writing back every chunk completed by this write, and wait for and drop the chunk before it,
+            // whose writeback was started earlier and has most likely finished by now
+            for (; chunk_begin + FILE_SYNC_CHUNK_BYTES <= written_; chunk_begin += FILE_SYNC_CHUNK_BYTES) {
+                sync_file_range(fd_, chunk_begin, FILE_SYNC_CHUNK_BYTES, SYNC_FILE_RANGE_WRITE);
+                if (chunk_begin >= FILE_SYNC_CHUNK_BYTES) {
+                    uint64 previous = chunk_begin - FILE_SYNC_CHUNK_BYTES;
+                    sync_file_range(fd_, previous, FILE_SYNC_CHUNK_BYTES,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                    posix_fadvise(fd_, previous, FILE_SYNC_CHUNK_BYTES, POSIX_FADV_DONTNEED);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool write_all(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t count = ::write(fd_, data, size);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                // A write of nothing without an error sets no errno
+                if (count == 0) {
+                    errno = EIO;
+                }
+                fail();
+                return false;
+            }
+            data += count;
+            size -= count;
+            written_ += count;
+        }
+        return true;
+    }
+
+    // Keep the errno of the first failure, later calls on a failed file may set an unrelated one
+    void fail() {
+        if (error_ == 0) {
+            error_ = errno;
+        }
+    }
+
+    struct FreeDeleter {
+        void operator()(char* buffer) const {
+            std::free(buffer);
+        }
+    };
+
+    FileSyncMode mode_;
+    int fd_{-1};
+    std::unique_ptr<char, FreeDeleter> buffer_;
+    size_t buffered_{0};
+    uint64 written_{0};
+    bool preallocated_{false};
+    int error_{0};
+};
+
+} // namespace urlfetcher::server
+
+#endif // INCLUDED_FILESINK_HPP
@@ -0,0 +1,225 @@
+#ifndef INCLUDED_REPLAYUPSTREAM_HPP
+#define INCLUDED_REPLAYUPSTREAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <google/protobuf/stubs/common.h>
+
+
+namespace urlfetcher {
+
+using google::protobuf::uint64;
+
+constexpr size_t REPLAY_MAX_REQUEST_BYTES{8192};
+constexpr size_t REPLAY_WRITE_CHUNK_BYTES{16 * 1024};
+
+
+// Response shape encoded into a URL by replay_url
+struct ReplayedResponse {
+    uint64 latency_us{0};
+    uint64 body_size{0};
+    unsigned http_status{0};
+    std::string body_seed;
+};
+
+// Parse a path of the form /replay/<latency_us>/<body_size>/<http_status>/<body_seed>
+bool parse_replay_path(const std::string& path, ReplayedResponse* replayed) {
+    std::stringstream components(path);
+    std::string prefix, latency_us, body_size, http_status;
+    std::getline(components, prefix, '/');
+    if (!prefix.empty() || !std::getline(components, prefix, '/') || prefix != "replay") {
+        return false;
+    }
+    if (!std::getline(components, latency_us, '/')
+            || !std::getline(components, body_size, '/')
+            || !std::getline(components, http_status, '/')
+            || !std::getline(components, replayed->body_seed)
+            || replayed->body_seed.empty()) {
+        return false;
+    }
+    try {
+        replayed->latency_us = std::stoull(latency_us);
+        replayed->body_size = std::stoull(body_size);
+        replayed->http_status = std::stoul(http_status);
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+
+// Minimal local HTTP server standing in for the upstream hosts of a recorded trace.
+// A GET on a URL from replay_url is answered after the recorded latency, divided by speed,
+// with the recorded status and a body of the recorded size.
+// A recorded status of 0, i.e. a fetch that got no response, is replayed by closing the connection without a response.
+// Each connection is served by its own thread and closed after one response, as cURL opens a new one for every fetch.
+class ReplayUpstream final {
+public:
+    // Listen on 127.0.0.1 at port, or at a free port if port is 0
+    explicit ReplayUpstream(int port = 0, double speed = 1.0) : speed_(speed > 0 ? speed : 1.0) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            return;
+        }
+        int reuse{1};
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t address_size = sizeof(address);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), address_size) != 0
+                || listen(listen_fd_, SOMAXCONN) != 0
+                || getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &address_size) != 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return;
+        }
+        port_ = ntohs(address.sin_port);
+        acceptor_ = std::thread(&ReplayUpstream::accept_loop, this);
+    }
+    ~ReplayUpstream() noexcept {
+        if (listen_fd_ < 0) {
+            return;
+        }
+        is_serving_ = false;
+        // Wakes up the blocking accept
+        shutdown(listen_fd_, SHUT_RDWR);
+        acceptor_.join();
+        close(listen_fd_);
+        std::unique_lock<std::mutex> guard(connections_mutex_);
+        connections_closed_.wait(guard, [this] { return num_connections_ == 0; });
+    }
+    // The acceptor and connection threads hold a pointer to the instance
+    ReplayUpstream (const ReplayUpstream&) = delete;
+    ReplayUpstream (ReplayUpstream&&) = delete;
+    ReplayUpstream& operator=(const ReplayUpstream&) = delete;
+    ReplayUpstream& operator=(ReplayUpstream&&) = delete;
+
+    bool is_listening() const {
+        return listen_fd_ >= 0;
+    }
+
+    std::string address() const {
+        return "127.0.0.1:" + std::to_string(port_);
+    }
+
+private:
+    void accept_loop() {
+        while (is_serving_) {
+            int connection_fd = accept(listen_fd_, nullptr, nullptr);
+            if (connection_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            {
+                std::unique_lock<std::mutex> guard(connections_mutex_);
+                ++num_connections_;
+            }
+            std::thread(&ReplayUpstream::serve, this, connection_fd).detach();
+        }
+    }
+
+    void serve(int connection_fd) {
+        ReplayedResponse replayed;
+        std::string path;
+        bool valid = read_request_path(connection_fd, &path) && parse_replay_path(path, &replayed);
+        if (!valid) {
+            std::string not_found{"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"};
+            send_all(connection_fd, not_found.data(), not_found.size());
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::microseconds(static_cast<uint64>(replayed.latency_us / speed_)));
+            if (replayed.http_status > 0) {
+                send_response(connection_fd, replayed);
+            }
+        }
+        close(connection_fd);
+        // Notifies while holding the lock, the destructor may destroy the condition variable as soon as it is released
+        std::unique_lock<std::mutex> guard(connections_mutex_);
+        --num_connections_;
+        connections_closed_.notify_all();
+    }
+
+    static bool read_request_path(int connection_fd, std::string* path) {
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            if (request.size() > REPLAY_MAX_REQUEST_BYTES) {
+                return false;
+            }
+            ssize_t received = recv(connection_fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                return false;
+            }
+            request.append(buffer, received);
+        }
+        // Request line: GET <path> HTTP/1.1
+        std::stringstream request_line(request.substr(0, request.find("\r\n")));
+        std::string method;
+        request_line >> method >> *path;
+        return method == "GET" && !path->empty();
+    }
+
+    static void send_response(int connection_fd, const ReplayedResponse& replayed) {
+        std::string header = "HTTP/1.1 " + std::to_string(replayed.http_status) + " Replayed\r\n"
+            + "Content-Length: " + std::to_string(replayed.body_size) + "\r\n"
+            + "Connection: close\r\n\r\n";
+        if (!send_all(connection_fd, header.data(), header.size())) {
+            return;
+        }
+        // The body repeats the seed, written in fixed size chunks so that large bodies take no extra memory
+        std::string chunk;
+        while (chunk.size() < REPLAY_WRITE_CHUNK_BYTES) {
+            chunk += replayed.body_seed;
+        }
+        chunk.resize(REPLAY_WRITE_CHUNK_BYTES);
+        for (uint64 sent = 0; sent < replayed.body_size; sent += chunk.size()) {
+            size_t size = std::min<uint64>(chunk.size(), replayed.body_size - sent);
+            if (!send_all(connection_fd, chunk.data(), size)) {
+                return;
+            }
+        }
+    }
+
+    static bool send_all(int connection_fd, const char* data, size_t size) {
+        for (size_t sent = 0; sent < size; ) {
+            ssize_t written = send(connection_fd, data + sent, size - sent, MSG_NOSIGNAL);
+            if (written <= 0) {
+                return false;
+            }
+            sent += written;
+        }
+        return true;
+    }
+
+    const double speed_;
+    int listen_fd_{-1};
+    int port_{0};
+    std::atomic<bool> is_serving_{true};
+    std::thread acceptor_;
+    int num_connections_{0};
+    std::mutex connections_mutex_;
+    std::condition_variable connections_closed_;
+};
+
+} // namespace urlfetcher
+
+#endif // INCLUDED_REPLAYUPSTREAM_HPP
@@ -0,0 +1,108 @@
+#ifndef INCLUDED_TRAFFICTRACE_HPP
+#define INCLUDED_TRAFFICTRACE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include <fmt/format.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/util/delimited_message_util.h>
+
+#include "BodyStore.hpp"
+#include "urlfetcher.grpc.pb.h"
+
+
+namespace urlfetcher {
+
+using google::protobuf::uint64;
+
+
+// Appends one length-delimited TraceRecord per completed fetch to a file, shared by all fetcher threads of a server.
+// Arrival times are counted from the construction of the writer.
+class TrafficTraceWriter final {
+public:
+    explicit TrafficTraceWriter(const std::string& path)
+        : file_(path, std::ios::binary | std::ios::trunc),
+          output_(&file_),
+          start_(std::chrono::steady_clock::now()) {
+    }
+
+    bool is_open() const {
+        return file_.is_open();
+    }
+
+    void write(
+            uint64 session,
+            std::chrono::steady_clock::time_point arrival,
+            const std::string& url,
+            std::chrono::steady_clock::time_point fetch_started,
+            std::chrono::steady_clock::time_point fetch_finished,
+            const Response& response) {
+        TraceRecord record;
+        record.set_arrival_us(microseconds(arrival - start_));
+        record.set_session(session);
+        record.set_url(url);
+        record.set_latency_us(microseconds(fetch_finished - fetch_started));
+        // A download has its body in a file instead of the response
+        record.set_body_size(response.file_path().empty() ? response.body().size() : response.file_size());
+        record.set_http_status(response.http_status());
+        record.set_curl_error(response.curl_error());
+        std::unique_lock<std::mutex> guard(mutex_);
+        google::protobuf::util::SerializeDelimitedToZeroCopyStream(record, &output_);
+    }
+
+private:
+    static uint64 microseconds(std::chrono::steady_clock::duration duration) {
+        return std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    }
+
+    // Declared before output_, which flushes into file_ when destroyed
+    std::ofstream file_;
+    google::protobuf::io::OstreamOutputStream output_;
+    const std::chrono::steady_clock::time_point start_;
+    std::mutex mutex_;
+};
+
+
+// Reads back the records written by TrafficTraceWriter, in the order they were written
+class TrafficTraceReader final {
+public:
+    explicit TrafficTraceReader(const std::string& path)
+        : file_(path, std::ios::binary),
+          input_(&file_) {
+    }
+
+    bool is_open() const {
+        return file_.is_open();
+    }
+
+    // Returns false at the end of the trace or if the rest of it cannot be parsed
+    bool next(TraceRecord* record) {
+        return google::protobuf::util::ParseDelimitedFromZeroCopyStream(record, &input_, nullptr);
+    }
+
+private:
+    std::ifstream file_;
+    google::protobuf::io::IstreamInputStream input_;
+};
+
+
+// URL at which ReplayUpstream, listening on upstream_address, reproduces the latency, body size and status of record.
+// The last path component is the digest of the recorded URL, from which the upstream derives the body,
+// so that equal URLs still get equal bodies and different URLs different ones.
+std::string replay_url(const TraceRecord& record, const std::string& upstream_address) {
+    return fmt::format("http://{:s}/replay/{:d}/{:d}/{:d}/{:016x}",
+            upstream_address,
+            record.latency_us(),
+            record.body_size(),
+            record.http_status(),
+            server::BodyHasher::digest_of(record.url()));
+}
+
+} // namespace urlfetcher
+
+#endif // INCLUDED_TRAFFICTRACE_HPP
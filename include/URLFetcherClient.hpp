@@ -1,10 +1,14 @@
 #ifndef INCLUDED_URLFETCHERCLIENT_HPP
 #define INCLUDED_URLFETCHERCLIENT_HPP
 
+#include <algorithm>
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <queue>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <google/protobuf/stubs/common.h>
@@ -12,6 +16,7 @@
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/spdlog.h>
 
+#include "FetchKey.hpp"
 #include "urlfetcher.grpc.pb.h"
 
 
@@ -21,31 +26,277 @@ using google::protobuf::uint64;
 using grpc::ClientContext;
 using grpc::ClientReaderWriter;
 using grpc::Status;
+using urlfetcher::LoadReport;
+using urlfetcher::LoadRequest;
 using urlfetcher::PendingFetch;
+using urlfetcher::PendingFetchBatch;
 using urlfetcher::Request;
+using urlfetcher::RequestBatch;
 using urlfetcher::Response;
+using urlfetcher::ResponseBatch;
 using urlfetcher::URLFetcher;
+using urlfetcher::is_valid_key;
+using urlfetcher::replica_of_key;
 
 
 auto logger = spdlog::stdout_logger_mt("URLFetcherClient");
 
+constexpr size_t DEFAULT_FETCH_BATCH_SIZE{512};
+constexpr int GET_LOAD_TIMEOUT_MS{1000};
+// curl_error of the responses for keys that were not resolved, e.g. because the stream broke or the key was 0.
+// cURL error codes are never negative.
+constexpr int UNRESOLVED_FETCH_ERROR{-1};
+
+Response unresolved_response() {
+    Response response;
+    response.set_curl_error(UNRESOLVED_FETCH_ERROR);
+    return response;
+}
+
 
 class URLFetcherClient final {
 public:
-    explicit URLFetcherClient(const std::string& server_address) {
-        logger->debug("Creating URLFetcherClient with server address '{:s}'", server_address);
-        auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
-        stub_ = URLFetcher::NewStub(channel);
+    explicit URLFetcherClient(const std::string& server_address)
+        : URLFetcherClient(std::vector<std::string>{server_address}) {
+    }
+
+    // Client for several replicas of the same service.
+    // New fetches are spread across the replicas according to the load they report,
+    // and every key is resolved at the replica that returned it.
+    explicit URLFetcherClient(const std::vector<std::string>& server_addresses) {
+        for (const auto& server_address : server_addresses) {
+            logger->debug("Creating URLFetcherClient with server address '{:s}'", server_address);
+            auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+            replicas_.push_back(Replica{server_address, URLFetcher::NewStub(channel)});
+        }
+        if (replicas_.size() > 1) {
+            refresh_load();
+        }
+    }
+
+    // Ask every replica for its replica id and current load.
+    // Replicas that do not answer, or that report the replica id of another address, get no new fetches
+    // until a later refresh_load succeeds for them.
+    void refresh_load() {
+        for (int i = 0; i < replicas_.size(); ++i) {
+            refresh_load(i);
+        }
+    }
+
+    // Returns one key for each URL, in the same order.
+    // URLs that could not be requested get the key 0, which is never a valid key.
+    // With download_to_file, the servers write the bodies into files in their download directory
+    // and the responses carry the path, size and digest of each file instead of the body.
+    std::vector<uint64> request_fetches(const std::vector<std::string>& urls, bool download_to_file = false) {
+        if (replicas_.size() == 1) {
+            return request_fetches_from(replicas_[0], urls, download_to_file);
+        }
+        return scatter_gather<std::string, uint64>(urls, assign_to_replicas(urls.size()),
+                [this, download_to_file](Replica& replica, const std::vector<std::string>& replica_urls) {
+                    return request_fetches_from(replica, replica_urls, download_to_file);
+                },
+                uint64{0});
+    }
+
+    // If omit_known_bodies is set, the server sends each distinct body at most once on the stream
+    // and the duplicates are filled in from the first response with the same digest.
+    // Responses with a digest in known_body_digests are returned with body_omitted set and an empty body,
+    // since the caller already holds those bodies.
+    // Keys that could not be resolved, including the key 0, get a response with curl_error UNRESOLVED_FETCH_ERROR.
+    std::vector<Response> resolve_fetches(
+            const std::vector<uint64>& keys,
+            bool omit_known_bodies = false,
+            const std::vector<uint64>& known_body_digests = {}) {
+        return scatter_gather<uint64, Response>(keys, owners_of_keys(keys),
+                [&](Replica& replica, const std::vector<uint64>& replica_keys) {
+                    return resolve_fetches_from(replica, replica_keys, omit_known_bodies, known_body_digests);
+                },
+                unresolved_response());
+    }
+
+    // Same as request_fetches, but sends the URLs batch_size at a time with RequestFetchBatch.
+    // A batch_size of 0 is treated as 1.
+    std::vector<uint64> request_fetches_in_batches(
+            const std::vector<std::string>& urls,
+            size_t batch_size = DEFAULT_FETCH_BATCH_SIZE,
+            bool download_to_file = false) {
+        if (replicas_.size() == 1) {
+            return request_fetch_batches_from(replicas_[0], urls, batch_size, download_to_file);
+        }
+        return scatter_gather<std::string, uint64>(urls, assign_to_replicas(urls.size()),
+                [this, batch_size, download_to_file](Replica& replica, const std::vector<std::string>& replica_urls) {
+                    return request_fetch_batches_from(replica, replica_urls, batch_size, download_to_file);
+                },
+                uint64{0});
+    }
+
+    // Same as resolve_fetches, but sends the keys batch_size at a time with ResolveFetchBatch.
+    // A batch_size of 0 is treated as 1.
+    std::vector<Response> resolve_fetches_in_batches(
+            const std::vector<uint64>& keys,
+            size_t batch_size = DEFAULT_FETCH_BATCH_SIZE,
+            bool omit_known_bodies = false,
+            const std::vector<uint64>& known_body_digests = {}) {
+        return scatter_gather<uint64, Response>(keys, owners_of_keys(keys),
+                [&](Replica& replica, const std::vector<uint64>& replica_keys) {
+                    return resolve_fetch_batches_from(replica, replica_keys, batch_size, omit_known_bodies, known_body_digests);
+                },
+                unresolved_response());
+    }
+
+private:
+    struct Replica {
+        std::string address;
+        std::unique_ptr<URLFetcher::Stub> stub;
+        // Last reported load, updated from GetLoad and the trailing metadata of RequestFetch
+        uint64 queued_fetches{0};
+        unsigned num_fetcher_threads{1};
+        // Whether the last GetLoad succeeded with a replica id no other address reported
+        bool is_reachable{false};
+    };
+
+    void refresh_load(int i) {
+        Replica& replica = replicas_[i];
+        ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(GET_LOAD_TIMEOUT_MS));
+        LoadReport report;
+        Status status = replica.stub->GetLoad(&context, LoadRequest{}, &report);
+        replica.is_reachable = false;
+        if (!status.ok()) {
+            logger->warn("GetLoad failed for replica at '{:s}': {:s}", replica.address, status.error_message());
+            return;
+        }
+        auto [item, is_new] = replica_index_.emplace(report.replica_id(), i);
+        if (!is_new && item->second != i) {
+            logger->error("Replica at '{:s}' reports the replica id {:d} of the replica at '{:s}', not sending it any fetches",
+                    replica.address, report.replica_id(), replicas_[item->second].address);
+            return;
+        }
+        logger->debug("Replica {:d} at '{:s}' has {:d} queued fetches",
+                report.replica_id(), replica.address, report.queued_fetches());
+        replica.queued_fetches = report.queued_fetches();
+        replica.num_fetcher_threads = std::max(1u, report.num_fetcher_threads());
+        replica.is_reachable = true;
+    }
+
+    // Index of the replica that owns each key, every key must be resolved there.
+    // Invalid keys, such as the key 0 of a failed request, get -1.
+    std::vector<int> owners_of_keys(const std::vector<uint64>& keys) {
+        std::vector<int> owners(keys.size());
+        for (int i = 0; i < keys.size(); ++i) {
+            if (!is_valid_key(keys[i])) {
+                logger->warn("Not resolving invalid key {:d}", keys[i]);
+                owners[i] = -1;
+                continue;
+            }
+            if (replicas_.size() == 1) {
+                owners[i] = 0;
+                continue;
+            }
+            auto item = replica_index_.find(replica_of_key(keys[i]));
+            if (item == replica_index_.end()) {
+                logger->warn("Not resolving key {:d} of unknown replica {:d}", keys[i], replica_of_key(keys[i]));
+                owners[i] = -1;
+            }
+            else {
+                owners[i] = item->second;
+            }
+        }
+        return owners;
+    }
+
+    // Assign each of num_urls URLs to the reachable replica with the least queued fetches per fetcher thread,
+    // counting the URLs already assigned to it.
+    // Unreachable replicas are asked for their load again first, and get no URLs if they still do not answer.
+    std::vector<int> assign_to_replicas(size_t num_urls) {
+        using ReplicaLoad = std::pair<double, int>;
+        std::priority_queue<ReplicaLoad, std::vector<ReplicaLoad>, std::greater<ReplicaLoad> > loads;
+        std::vector<uint64> assigned(replicas_.size());
+        auto load_of = [this, &assigned](int i) {
+            return static_cast<double>(replicas_[i].queued_fetches + assigned[i]) / replicas_[i].num_fetcher_threads;
+        };
+        for (int i = 0; i < replicas_.size(); ++i) {
+            if (!replicas_[i].is_reachable) {
+                refresh_load(i);
+            }
+            if (replicas_[i].is_reachable) {
+                loads.emplace(load_of(i), i);
+            }
+        }
+        if (loads.empty()) {
+            logger->error("None of the {:d} replicas is reachable", replicas_.size());
+            return std::vector<int>(num_urls, -1);
+        }
+        std::vector<int> replica_of_url(num_urls);
+        for (auto& replica_index : replica_of_url) {
+            int i = loads.top().second;
+            loads.pop();
+            replica_index = i;
+            ++assigned[i];
+            loads.emplace(load_of(i), i);
+        }
+        return replica_of_url;
+    }
+
+    // Split items by their replica, call fn for every replica concurrently,
+    // and gather the results back into the order of items.
+    // Items of replica -1 and items a replica returned no result for get the result missing.
+    template <typename Item, typename Result, typename Fn>
+    std::vector<Result> scatter_gather(
+            const std::vector<Item>& items,
+            const std::vector<int>& replica_of_item,
+            Fn fn,
+            const Result& missing) {
+        std::vector<std::vector<Item> > replica_items(replicas_.size());
+        std::vector<std::vector<size_t> > replica_positions(replicas_.size());
+        for (size_t pos = 0; pos < items.size(); ++pos) {
+            if (replica_of_item[pos] < 0) {
+                continue;
+            }
+            replica_items[replica_of_item[pos]].push_back(items[pos]);
+            replica_positions[replica_of_item[pos]].push_back(pos);
+        }
+        std::vector<Result> results(items.size(), missing);
+        auto gather = [&](int i) {
+            std::vector<Result> replica_results = fn(replicas_[i], replica_items[i]);
+            if (replica_results.size() != replica_items[i].size()) {
+                logger->warn("Replica at '{:s}' returned {:d} results for {:d} items",
+                        replicas_[i].address, replica_results.size(), replica_items[i].size());
+            }
+            for (size_t j = 0; j < std::min(replica_results.size(), replica_positions[i].size()); ++j) {
+                results[replica_positions[i][j]] = std::move(replica_results[j]);
+            }
+        };
+        std::vector<int> busy_replicas;
+        for (int i = 0; i < replicas_.size(); ++i) {
+            if (!replica_items[i].empty()) {
+                busy_replicas.push_back(i);
+            }
+        }
+        // No need for a thread if a single replica has all the items
+        if (busy_replicas.size() == 1) {
+            gather(busy_replicas[0]);
+            return results;
+        }
+        std::vector<std::thread> workers;
+        for (int i : busy_replicas) {
+            workers.emplace_back(gather, i);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return results;
     }
 
-    std::vector<uint64> request_fetches(const std::vector<std::string>& urls) {
-        logger->info("Requesting {:d} urls from server", urls.size());
+    std::vector<uint64> request_fetches_from(Replica& replica, const std::vector<std::string>& urls, bool download_to_file) {
+        logger->info("Requesting {:d} urls from server '{:s}'", urls.size(), replica.address);
         ClientContext context;
-        std::shared_ptr<ClientReaderWriter<Request, PendingFetch> > stream(stub_->RequestFetch(&context));
+        std::shared_ptr<ClientReaderWriter<Request, PendingFetch> > stream(replica.stub->RequestFetch(&context));
         for (auto url : urls) {
             logger->debug("Writing '{:s}' to stream", url);
             Request request;
             request.set_url(url);
+            request.set_download_to_file(download_to_file);
             stream->Write(request);
         }
         stream->WritesDone();
@@ -64,29 +315,100 @@ public:
                     status.error_message(),
                     status.error_details());
         }
+        update_load(replica, context);
+        // URLs without a key were not requested
+        keys.resize(urls.size(), 0);
         return keys;
     }
 
-    std::vector<Response> resolve_fetches(const std::vector<uint64>& keys) {
-        logger->info("Resolving {:d} pending fetches", keys.size());
+    std::vector<uint64> request_fetch_batches_from(
+            Replica& replica,
+            const std::vector<std::string>& urls,
+            size_t batch_size,
+            bool download_to_file) {
+        batch_size = std::max<size_t>(1, batch_size);
+        logger->info("Requesting {:d} urls in batches of {:d} from server '{:s}'", urls.size(), batch_size, replica.address);
         ClientContext context;
-        std::shared_ptr<ClientReaderWriter<PendingFetch, Response> > stream(stub_->ResolveFetch(&context));
-        for (auto key : keys) {
-            logger->debug("Writing {:d} to stream", key);
+        std::shared_ptr<ClientReaderWriter<RequestBatch, PendingFetchBatch> > stream(replica.stub->RequestFetchBatch(&context));
+        for (size_t begin = 0; begin < urls.size(); begin += batch_size) {
+            RequestBatch request_batch;
+            auto end = std::min(begin + batch_size, urls.size());
+            request_batch.set_download_to_file(download_to_file);
+            request_batch.mutable_urls()->Reserve(end - begin);
+            for (auto i = begin; i < end; ++i) {
+                request_batch.add_urls(urls[i]);
+            }
+            logger->debug("Writing batch of {:d} urls to stream", request_batch.urls_size());
+            stream->Write(request_batch);
+        }
+        stream->WritesDone();
+        std::vector<uint64> keys;
+        keys.reserve(urls.size());
+        PendingFetchBatch pending_batch;
+        while (stream->Read(&pending_batch)) {
+            logger->info("Received batch of {:d} pending fetches", pending_batch.keys_size());
+            keys.insert(keys.end(), pending_batch.keys().begin(), pending_batch.keys().end());
+        }
+        Status status = stream->Finish();
+        if (!status.ok()) {
+            logger->warn("RequestFetchBatch RPC stream finished with errors:\n   code: {:d}\n  message: {:s}\n  details: {:s}",
+                    status.error_code(),
+                    status.error_message(),
+                    status.error_details());
+        }
+        update_load(replica, context);
+        // URLs without a key were not requested
+        keys.resize(urls.size(), 0);
+        return keys;
+    }
+
+    // Take the queue depth reported in the trailing metadata of a finished RequestFetch or RequestFetchBatch
+    static void update_load(Replica& replica, const ClientContext& context) {
+        const auto& trailing_metadata = context.GetServerTrailingMetadata();
+        auto queued_fetches = trailing_metadata.find("urlfetcher-queued-fetches");
+        if (queued_fetches != trailing_metadata.end()) {
+            replica.queued_fetches = std::stoull(std::string(queued_fetches->second.data(), queued_fetches->second.size()));
+        }
+    }
+
+    std::vector<Response> resolve_fetches_from(
+            Replica& replica,
+            const std::vector<uint64>& keys,
+            bool omit_known_bodies,
+            const std::vector<uint64>& known_body_digests) {
+        logger->info("Resolving {:d} pending fetches from server '{:s}'", keys.size(), replica.address);
+        ClientContext context;
+        std::shared_ptr<ClientReaderWriter<PendingFetch, Response> > stream(replica.stub->ResolveFetch(&context));
+        for (int i = 0; i < keys.size(); ++i) {
+            logger->debug("Writing {:d} to stream", keys[i]);
             PendingFetch pending_fetch;
-            pending_fetch.set_key(key);
+            pending_fetch.set_key(keys[i]);
+            if (omit_known_bodies) {
+                pending_fetch.set_omit_known_bodies(true);
+                // Known digests accumulate on the server for the whole stream, so they are sent only once
+                if (i == 0) {
+                    for (auto digest : known_body_digests) {
+                        pending_fetch.add_known_body_digests(digest);
+                    }
+                }
+            }
             stream->Write(pending_fetch);
         }
         stream->WritesDone();
         logger->debug("All {:d} keys written to stream", keys.size());
         std::vector<Response> responses;
         responses.reserve(keys.size());
+        // Index of the first response received on this stream for each body digest
+        std::unordered_map<uint64, size_t> first_response_with_digest;
         Response response;
         while (stream->Read(&response)) {
             logger->info("Received response, header size {:d}, body size {:d}, error code {:d}",
                 response.header().size(),
                 response.body().size(),
                 response.curl_error());
+            if (omit_known_bodies) {
+                fill_omitted_body(response, responses, first_response_with_digest);
+            }
             responses.push_back(response);
         }
         Status status = stream->Finish();
@@ -99,8 +421,82 @@ public:
         return responses;
     }
 
-private:
-    std::unique_ptr<URLFetcher::Stub> stub_;
+    std::vector<Response> resolve_fetch_batches_from(
+            Replica& replica,
+            const std::vector<uint64>& keys,
+            size_t batch_size,
+            bool omit_known_bodies,
+            const std::vector<uint64>& known_body_digests) {
+        batch_size = std::max<size_t>(1, batch_size);
+        logger->info("Resolving {:d} pending fetches in batches of {:d} from server '{:s}'", keys.size(), batch_size, replica.address);
+        ClientContext context;
+        std::shared_ptr<ClientReaderWriter<PendingFetchBatch, ResponseBatch> > stream(replica.stub->ResolveFetchBatch(&context));
+        for (size_t begin = 0; begin < keys.size(); begin += batch_size) {
+            PendingFetchBatch pending_batch;
+            auto end = std::min(begin + batch_size, keys.size());
+            pending_batch.mutable_keys()->Reserve(end - begin);
+            for (auto i = begin; i < end; ++i) {
+                pending_batch.add_keys(keys[i]);
+            }
+            if (omit_known_bodies) {
+                pending_batch.set_omit_known_bodies(true);
+                if (begin == 0) {
+                    for (auto digest : known_body_digests) {
+                        pending_batch.add_known_body_digests(digest);
+                    }
+                }
+            }
+            logger->debug("Writing batch of {:d} keys to stream", pending_batch.keys_size());
+            stream->Write(pending_batch);
+        }
+        stream->WritesDone();
+        std::vector<Response> responses;
+        responses.reserve(keys.size());
+        std::unordered_map<uint64, size_t> first_response_with_digest;
+        ResponseBatch response_batch;
+        while (stream->Read(&response_batch)) {
+            logger->info("Received batch of {:d} responses", response_batch.responses_size());
+            for (auto& response : *response_batch.mutable_responses()) {
+                if (omit_known_bodies) {
+                    fill_omitted_body(response, responses, first_response_with_digest);
+                }
+                responses.push_back(std::move(response));
+            }
+        }
+        Status status = stream->Finish();
+        if (!status.ok()) {
+            logger->warn("ResolveFetchBatch RPC stream finished with errors:\n   code: {:d}\n  message: {:s}\n  details: {:s}",
+                    status.error_code(),
+                    status.error_message(),
+                    status.error_details());
+        }
+        return responses;
+    }
+
+    // Fill in the body of response if the server omitted it because it was sent earlier on the same stream,
+    // otherwise remember where the body was first received
+    static void fill_omitted_body(
+            Response& response,
+            const std::vector<Response>& responses,
+            std::unordered_map<uint64, size_t>& first_response_with_digest) {
+        // Downloads have their body in a file and are never omitted
+        if (response.curl_error() != 0 || !response.file_path().empty()) {
+            return;
+        }
+        auto first = first_response_with_digest.find(response.body_digest());
+        if (response.body_omitted() && first != first_response_with_digest.end()) {
+            logger->debug("Filling in omitted body with digest {:x}", response.body_digest());
+            response.set_body(responses[first->second].body());
+            response.set_body_omitted(false);
+        }
+        else if (!response.body_omitted() && first == first_response_with_digest.end()) {
+            first_response_with_digest.emplace(response.body_digest(), responses.size());
+        }
+    }
+
+    std::vector<Replica> replicas_;
+    // Index into replicas_ for each replica id reported by GetLoad
+    std::unordered_map<int, int> replica_index_;
 };
 
 
@@ -110,6 +506,12 @@ std::vector<Response> fetch_urls_from_server(const std::vector<std::string>& url
     return fetcher.resolve_fetches(keys);
 }
 
+std::vector<Response> fetch_urls_from_server(const std::vector<std::string>& urls, const std::vector<std::string>& server_addresses) {
+    URLFetcherClient fetcher(server_addresses);
+    auto keys = fetcher.request_fetches(urls);
+    return fetcher.resolve_fetches(keys);
+}
+
 
 } // namespace urlfetcher
 
@@ -1,21 +1,39 @@
 #ifndef INCLUDED_URLFETCHERSERVER_HPP
 #define INCLUDED_URLFETCHERSERVER_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <concurrentqueue/blockingconcurrentqueue.h>
 #include <curl/curl.h>
+#include <fmt/format.h>
 #include <google/protobuf/stubs/common.h>
 #include <grpcpp/grpcpp.h>
+#include <pthread.h>
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/spdlog.h>
+#include <unistd.h>
 
+#include "BodyStore.hpp"
+#include "CpuTopology.hpp"
+#include "FileSink.hpp"
+#include "FetchKey.hpp"
+#include "TrafficTrace.hpp"
 #include "urlfetcher.grpc.pb.h"
 
 
@@ -27,10 +45,22 @@ using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 using google::protobuf::uint64;
+using urlfetcher::LoadReport;
+using urlfetcher::LoadRequest;
+using urlfetcher::MAX_NUM_REPLICAS;
+using urlfetcher::MAX_NUM_SHARDS;
 using urlfetcher::PendingFetch;
+using urlfetcher::PendingFetchBatch;
 using urlfetcher::Request;
+using urlfetcher::RequestBatch;
 using urlfetcher::Response;
+using urlfetcher::ResponseBatch;
+using urlfetcher::TrafficTraceWriter;
 using urlfetcher::URLFetcher;
+using urlfetcher::is_valid_key;
+using urlfetcher::make_key;
+using urlfetcher::replica_of_key;
+using urlfetcher::shard_of_key;
 
 
 auto logger = spdlog::stdout_logger_mt("URLFetcherServer");
@@ -38,6 +68,8 @@ auto logger = spdlog::stdout_logger_mt("URLFetcherServer");
 constexpr long TIMEOUT_CURL_GET_MS{60'000L};
 constexpr int NUM_FETCH_THREADS{8};
 constexpr int FETCHER_THREAD_WAIT_ON_EMPTY_MS{200};
+// ResolveFetchBatch bundles ready responses into one ResponseBatch up to approximately this size
+constexpr size_t RESPONSE_BATCH_MAX_BYTES{1024 * 1024};
 
 
 size_t curl_response_to_std_string(void* curl_response, size_t size, size_t nmemb, std::string* response) {
@@ -46,6 +78,17 @@ size_t curl_response_to_std_string(void* curl_response, size_t size, size_t nmem
     return response_size;
 }
 
+void set_GET_options(CURL* curl, const std::string& url, std::string* result_header) {
+    // Prepare to fetch given URL
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    // If requested URL is redirected, fetch the contents after redirection
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Timeout if there's no response within given time
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, TIMEOUT_CURL_GET_MS);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_response_to_std_string);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, result_header);
+}
+
 Response fetch_URL(const std::string& url) {
     std::unique_ptr<CURL, decltype(&curl_easy_cleanup)>
         curl{curl_easy_init(), &curl_easy_cleanup};
@@ -54,18 +97,12 @@ Response fetch_URL(const std::string& url) {
         return Response{};
     }
 
-    // Prepare to fetch given URL
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-    // If requested URL is redirected, fetch the contents after redirection
-    curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
-    // Timeout if there's no response within given time
-    curl_easy_setopt(curl.get(), CURLOPT_TIMEOUT_MS, TIMEOUT_CURL_GET_MS);
-
-    // On response, use callback to write header and body into two different strings
+    // On response, use callbacks to write header and body into two different strings,
+    // hashing the body while it streams in
     std::string result_header;
-    std::string result_body;
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curl_response_to_std_string);
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &result_header);
+    HashingBody result_body;
+    set_GET_options(curl.get(), url, &result_header);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curl_response_to_hashing_body);
     curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &result_body);
 
     // Perform the request
@@ -80,21 +117,423 @@ Response fetch_URL(const std::string& url) {
     else {
         logger->debug("cURL GET successful on '{:s}'", url);
         response.set_header(result_header);
-        response.set_body(result_body);
+        response.set_body(std::move(result_body.body));
+        response.set_body_digest(result_body.hasher.digest());
     }
+    long http_status{0};
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_status);
+    response.set_http_status(http_status);
     response.set_curl_error(error);
     return response;
 }
 
 
-class URLFetcherService final : public URLFetcher::Service {
+struct DownloadOptions {
+    // Directory, e.g. on a volume shared with the clients, into which bodies are downloaded.
+    // Requests with download_to_file are refused if empty.
+    std::string directory;
+    // Preallocate each file from the Content-Length of its response
+    bool preallocate{false};
+    FileSyncMode sync{FileSyncMode::none};
+};
+
+// cURL body sink that writes the body into a file, hashing it on the way
+struct DownloadBody {
+    CURL* curl;
+    FileSink* file;
+    bool preallocate;
+    BodyHasher hasher{};
+};
+
+size_t curl_response_to_file(void* curl_response, size_t size, size_t nmemb, DownloadBody* download) {
+    size_t response_size{size * nmemb};
+    // The Content-Length is known once the first part of the body arrives
+    if (download->preallocate) {
+        download->preallocate = false;
+        curl_off_t content_length{-1};
+        if (curl_easy_getinfo(download->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) == CURLE_OK
+                && content_length > 0) {
+            download->file->preallocate(content_length);
+        }
+    }
+    const char* data = static_cast<char*>(curl_response);
+    download->hasher.update(data, response_size);
+    // Returning less than response_size makes cURL abort the transfer with CURLE_WRITE_ERROR
+    return download->file->write(data, response_size) ? response_size : 0;
+}
+
+// Fetch url like fetch_URL, but stream the body into the file at path instead of keeping it in memory.
+// The body is written to path + ".part", which is renamed to path when the download is complete and removed if it fails.
+Response download_URL(const std::string& url, const std::string& path, const DownloadOptions& options) {
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)>
+        curl{curl_easy_init(), &curl_easy_cleanup};
+    if (!curl) {
+        logger->critical("Failed to initialize cURL instance, cannot request given URL '{:s}'", url);
+        return Response{};
+    }
+    Response response;
+    std::string part_path = path + ".part";
+    FileSink file(part_path, options.sync);
+    if (!file.is_open()) {
+        logger->error("Cannot open '{:s}' for downloading '{:s}': {:s}", part_path, url, std::strerror(file.error()));
+        response.set_curl_error(CURLE_WRITE_ERROR);
+        return response;
+    }
+    if (file.mode() != options.sync) {
+        logger->warn("O_DIRECT is not supported for '{:s}', writing through the page cache", part_path);
+    }
+
+    std::string result_header;
+    DownloadBody result_body{curl.get(), &file, options.preallocate};
+    set_GET_options(curl.get(), url, &result_header);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curl_response_to_file);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &result_body);
+
+    logger->debug("cURL downloading '{:s}' into '{:s}' with timeout {:d} ms", url, part_path, TIMEOUT_CURL_GET_MS);
+    CURLcode error = curl_easy_perform(curl.get());
+    if (!file.close()) {
+        logger->error("Failed to write '{:s}': {:s}", part_path, std::strerror(file.error()));
+        if (error == CURLE_OK) {
+            error = CURLE_WRITE_ERROR;
+        }
+    }
+    if (error == CURLE_OK && std::rename(part_path.c_str(), path.c_str()) != 0) {
+        logger->error("Failed to rename '{:s}' to '{:s}': {:s}", part_path, path, std::strerror(errno));
+        error = CURLE_WRITE_ERROR;
+    }
+
+    if (error != CURLE_OK) {
+        logger->error("cURL download failed with error string '{:s}'", curl_easy_strerror(error));
+        std::remove(part_path.c_str());
+    }
+    else {
+        logger->debug("cURL download successful on '{:s}', {:d} bytes written to '{:s}'", url, file.size(), path);
+        response.set_header(result_header);
+        response.set_file_path(path);
+        response.set_file_size(file.size());
+        response.set_body_digest(result_body.hasher.digest());
+    }
+    long http_status{0};
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_status);
+    response.set_http_status(http_status);
+    response.set_curl_error(error);
+    return response;
+}
+
+
+using FetchFunction = std::function<Response(const std::string&)>;
+// Fetch of a URL in download-to-file mode, given the key of the fetch
+using DownloadFunction = std::function<Response(uint64, const std::string&)>;
+// URL waiting in the fetch queue of a shard for a fetcher thread
+struct QueuedFetch {
+    uint64 key{0};
+    std::string url;
+    // Stream that carried the URL and when it arrived, only set when a traffic trace is recorded
+    uint64 session{0};
+    std::chrono::steady_clock::time_point arrival;
+    bool download_to_file{false};
+};
+using FetchQueue = moodycamel::BlockingConcurrentQueue<QueuedFetch>;
+
+struct ServerOptions {
+    // Number of fetcher threads in each shard
+    int num_fetcher_threads{NUM_FETCH_THREADS};
+    // Number of independent shards, each with its own fetch queue, fetcher threads and completed fetches
+    int num_shards{1};
+    // Pin the fetcher threads of each shard to a disjoint set of CPUs, chosen NUMA node by node
+    bool pin_threads{false};
+    // Id of this server among all replicas behind the same service, encoded into every key it returns
+    int replica_id{0};
+    FetchFunction fetch{fetch_URL};
+    // If not empty, record a traffic trace of all fetches into this file, see TrafficTrace.hpp
+    std::string trace_path;
+    DownloadOptions download;
+};
+
+
+struct FetchShardStages;
+
+// One shard of URLFetcherService, sharing nothing with the other shards
+class FetchShard final {
 public:
-    explicit URLFetcherService(int num_fetcher_threads) : fetchers_(num_fetcher_threads) {
+    // Completed fetches are recorded into trace if it is not null, it must outlive the shard
+    FetchShard(
+            int replica_id,
+            int shard_index,
+            int num_fetcher_threads,
+            FetchFunction fetch,
+            std::vector<int> cpus = {},
+            TrafficTraceWriter* trace = nullptr,
+            DownloadFunction download = nullptr)
+        : replica_id_(replica_id),
+          shard_index_(shard_index),
+          fetchers_(num_fetcher_threads),
+          fetch_(std::move(fetch)),
+          download_(std::move(download)),
+          cpus_(std::move(cpus)),
+          trace_(trace) {
         StartFetcherThreads();
     }
-    ~URLFetcherService() noexcept {
+    ~FetchShard() noexcept {
         StopFetcherThreads();
     }
+    // The fetcher threads hold a pointer to the shard
+    FetchShard (const FetchShard&) = delete;
+    FetchShard (FetchShard&&) = delete;
+    FetchShard& operator=(const FetchShard&) = delete;
+    FetchShard& operator=(FetchShard&&) = delete;
+
+    // Enqueue url for fetching and return the key of its pending fetch
+    uint64 submit_fetch(const std::string& url, uint64 session = 0, bool download_to_file = false) {
+        uint64 key = create_uuid();
+        fetch_queue_.enqueue({key, url, session, arrival_time(), download_to_file});
+        return key;
+    }
+
+    // Enqueue all urls at once and return their keys, which are consecutive
+    template <typename URLs>
+    std::vector<uint64> submit_fetches(const URLs& urls, uint64 session = 0, bool download_to_file = false) {
+        uint64 sequence = previous_uuid_.fetch_add(urls.size()) + 1;
+        auto arrival = arrival_time();
+        std::vector<uint64> keys;
+        std::vector<QueuedFetch> queued_fetches;
+        keys.reserve(urls.size());
+        queued_fetches.reserve(urls.size());
+        for (const auto& url : urls) {
+            keys.push_back(make_key(shard_index_, sequence++, replica_id_));
+            queued_fetches.push_back({keys.back(), url, session, arrival, download_to_file});
+        }
+        fetch_queue_.enqueue_bulk(std::make_move_iterator(queued_fetches.begin()), queued_fetches.size());
+        return keys;
+    }
+
+    bool is_completed(uint64 key) {
+        std::unique_lock<std::mutex> guard(queue_mutex_);
+        return completed_fetches_.find(key) != completed_fetches_.end();
+    }
+
+    // Wait until the fetch at key has completed, then remove it and write it into response.
+    // Returns false if the shard stopped fetching before the fetch completed.
+    bool resolve_fetch(uint64 key, Response* response, const std::unordered_set<uint64>* omit_digests = nullptr) {
+        {
+            std::unique_lock<std::mutex> guard(queue_mutex_);
+            fetch_completed_.wait(guard, [this, key] {
+                return !is_fetching_ || completed_fetches_.find(key) != completed_fetches_.end();
+            });
+            if (completed_fetches_.find(key) == completed_fetches_.end()) {
+                return false;
+            }
+        }
+        *response = pop_completed_fetch(key, omit_digests);
+        return true;
+    }
+
+    size_t num_queued_fetches() const {
+        return fetch_queue_.size_approx();
+    }
+
+    size_t num_completed_fetches() {
+        std::unique_lock<std::mutex> guard(queue_mutex_);
+        return completed_fetches_.size();
+    }
+
+    size_t num_fetcher_threads() const {
+        return fetchers_.size();
+    }
+
+    void StartFetcherThreads() {
+        logger->info("Starting {:d} fetcher threads in shard {:d}", fetchers_.size(), shard_index_);
+        is_fetching_ = true;
+        for (int i = 0; i < fetchers_.size(); ++i) {
+            if (fetchers_[i].joinable()) {
+                logger->warn("Will not overwrite fetcher thread {:d} with new thread because it is already running", i);
+            }
+            else {
+                logger->debug("Starting fetcher thread {:d}", i);
+                fetchers_[i] = std::thread(&FetchShard::URL_fetch_loop, this);
+                if (!cpus_.empty() && !pin_thread_to_cpus(fetchers_[i], cpus_)) {
+                    logger->warn("Failed to pin fetcher thread {:d} of shard {:d}", i, shard_index_);
+                }
+            }
+        }
+    }
+
+    void StopFetcherThreads() {
+        logger->info("Stopping {:d} fetcher threads in shard {:d}", fetchers_.size(), shard_index_);
+        {
+            std::unique_lock<std::mutex> guard(queue_mutex_);
+            is_fetching_ = false;
+        }
+        fetch_completed_.notify_all();
+        for (int i = 0; i < fetchers_.size(); ++i) {
+            if (!fetchers_[i].joinable()) {
+                logger->warn("Fetcher thread {:d} is not running, will not join it", i);
+            }
+            else {
+                logger->debug("Stopping fetcher thread {:d}", i);
+                fetchers_[i].join();
+            }
+        }
+    }
+
+private:
+    // Gives the component benchmarks access to the stages below, see benchmarks/components.cpp
+    friend struct FetchShardStages;
+
+    // create_uuid and write_completed_fetch are stages of submit_fetch and of the fetcher threads
+    uint64 create_uuid() {
+        return make_key(shard_index_, ++previous_uuid_, replica_id_);
+    }
+
+    void write_completed_fetch(uint64 key, Response&& response) {
+        CompletedFetch completed;
+        // Downloads have no body to store, their digest is that of the file
+        if (response.curl_error() == CURLE_OK && response.file_path().empty()) {
+            uint64 digest = response.body_digest();
+            std::string body{std::move(*response.mutable_body())};
+            response.clear_body();
+            completed.body_in_store = body_store_.acquire(digest, std::move(body));
+            if (!completed.body_in_store) {
+                logger->warn("Digest collision for key {:d} at digest {:x}, keeping body outside the body store", key, digest);
+                response.set_body(std::move(body));
+            }
+        }
+        completed.response = std::move(response);
+        {
+            std::unique_lock<std::mutex> guard(queue_mutex_);
+            auto item = completed_fetches_.find(key);
+            if (item != completed_fetches_.end()) {
+                logger->warn("Overwriting existing, completed fetch at key {:d}", key);
+                if (item->second.body_in_store) {
+                    body_store_.release(item->second.response.body_digest());
+                }
+            }
+            completed_fetches_[key] = std::move(completed);
+        }
+        fetch_completed_.notify_all();
+    }
+
+    // Reading the clock is skipped unless a traffic trace is recorded
+    std::chrono::steady_clock::time_point arrival_time() const {
+        return trace_ ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+    }
+
+    Response download(const QueuedFetch& queued) {
+        if (!download_) {
+            logger->error("Download-to-file requested for key {:d} but this shard has no download function", queued.key);
+            Response response;
+            response.set_curl_error(CURLE_WRITE_ERROR);
+            return response;
+        }
+        return download_(queued.key, queued.url);
+    }
+
+    void URL_fetch_loop() {
+        auto wait_on_empty_ms = std::chrono::milliseconds(FETCHER_THREAD_WAIT_ON_EMPTY_MS);
+        while (is_fetching_) {
+            QueuedFetch queued;
+            if (fetch_queue_.wait_dequeue_timed(queued, wait_on_empty_ms)) {
+                logger->debug("URL_fetch_loop handling key {:d} url '{:s}'", queued.key, queued.url);
+                auto fetch_started = arrival_time();
+                Response response = queued.download_to_file ? download(queued) : fetch_(queued.url);
+                if (trace_) {
+                    trace_->write(queued.session, queued.arrival, queued.url, fetch_started, std::chrono::steady_clock::now(), response);
+                }
+                write_completed_fetch(queued.key, std::move(response));
+            }
+        }
+    }
+
+    // Remove the completed fetch at key and return it with its body taken from the body store.
+    // The body is left out if its digest is in omit_digests.
+    Response pop_completed_fetch(uint64 key, const std::unordered_set<uint64>* omit_digests = nullptr) {
+        CompletedFetch completed;
+        {
+            std::unique_lock<std::mutex> guard(queue_mutex_);
+            auto item = completed_fetches_.find(key);
+            completed = std::move(item->second);
+            completed_fetches_.erase(item);
+        }
+        Response& response = completed.response;
+        uint64 digest = response.body_digest();
+        bool omit_body = response.curl_error() == CURLE_OK
+            && response.file_path().empty()
+            && omit_digests
+            && omit_digests->find(digest) != omit_digests->end();
+        if (omit_body) {
+            logger->debug("Client already holds body with digest {:x}, omitting body of key {:d}", digest, key);
+            response.clear_body();
+            response.set_body_omitted(true);
+        }
+        else if (completed.body_in_store) {
+            response.set_body(body_store_.get(digest));
+        }
+        if (completed.body_in_store) {
+            body_store_.release(digest);
+        }
+        return std::move(response);
+    }
+
+    // Completed fetch whose body has been moved into the body store, unless the body store rejected it on a digest collision
+    struct CompletedFetch {
+        Response response;
+        bool body_in_store{false};
+    };
+
+    const int replica_id_;
+    const int shard_index_;
+    std::atomic<uint64> previous_uuid_{0};
+    std::vector<std::thread> fetchers_;
+    FetchFunction fetch_;
+    DownloadFunction download_;
+    std::vector<int> cpus_;
+    TrafficTraceWriter* trace_;
+    std::atomic<bool> is_fetching_{false};
+    FetchQueue fetch_queue_;
+    std::unordered_map<uint64, CompletedFetch> completed_fetches_;
+    std::mutex queue_mutex_;
+    std::condition_variable fetch_completed_;
+    BodyStore body_store_;
+};
+
+
+class URLFetcherService final : public URLFetcher::Service {
+public:
+    explicit URLFetcherService(int num_fetcher_threads) : URLFetcherService(ServerOptions{num_fetcher_threads}) {
+    }
+    explicit URLFetcherService(const ServerOptions& options)
+        : replica_id_(options.replica_id),
+          download_directory_(options.download.directory) {
+        // A wrapped around id would hand out keys that collide with those of another replica
+        if (replica_id_ < 0 || replica_id_ >= MAX_NUM_REPLICAS) {
+            logger->critical("Replica id {:d} does not fit into keys, it must be from 0 to {:d}", replica_id_, MAX_NUM_REPLICAS - 1);
+            throw std::invalid_argument(fmt::format("replica id {:d} out of range", replica_id_));
+        }
+        if (!options.trace_path.empty()) {
+            trace_ = std::make_unique<TrafficTraceWriter>(options.trace_path);
+            if (!trace_->is_open()) {
+                logger->error("Cannot open traffic trace '{:s}' for writing, not recording traffic", options.trace_path);
+                trace_.reset();
+            }
+        }
+        DownloadFunction download;
+        if (!options.download.directory.empty()) {
+            // Keys start over with every run of the server, so the file names also carry a random id of this run
+            // to not overwrite the files of an earlier run, whose paths clients may still hold
+            std::random_device random;
+            std::string path_prefix = fmt::format("{:s}/{:08x}{:08x}-", options.download.directory, random(), random());
+            download = [download_options = options.download, path_prefix](uint64 key, const std::string& url) {
+                return download_URL(url, path_prefix + std::to_string(key), download_options);
+            };
+        }
+        int num_shards = std::clamp(options.num_shards, 1, MAX_NUM_SHARDS);
+        auto shard_cpus = options.pin_threads ? partition_cpus(num_shards) : std::vector<std::vector<int> >(num_shards);
+        logger->info("Creating {:d} shards for replica {:d}", num_shards, replica_id_);
+        for (int i = 0; i < num_shards; ++i) {
+            shards_.push_back(std::make_unique<FetchShard>(
+                        replica_id_, i, options.num_fetcher_threads, options.fetch, shard_cpus[i], trace_.get(), download));
+        }
+    }
     // Let's disallow copy and move semantics because our thread pool is tied to the instance of this class
     // Trying to copy or move it will require some additional thought
     URLFetcherService (const URLFetcherService&) = delete;
@@ -104,136 +543,304 @@ public:
 
     Status RequestFetch(ServerContext* context, ServerReaderWriter<PendingFetch, Request>* stream) override {
         logger->info("Reading URL fetch requests from stream");
+        // All URLs of one stream go to the same shard, which keeps the returned keys ordered
+        FetchShard& shard = choose_shard();
+        uint64 session = ++previous_session_;
         Request request;
         while (stream->Read(&request)) {
             logger->debug("Got URL '{:s}'", request.url());
+            if (request.download_to_file() && !downloads_enabled()) {
+                return download_disabled_status();
+            }
             PendingFetch pending_fetch;
-            uint64 key = create_uuid();
-            pending_fetch.set_key(key);
+            pending_fetch.set_key(shard.submit_fetch(request.url(), session, request.download_to_file()));
             stream->Write(pending_fetch);
-            fetch_queue_.enqueue({key, request.url()});
         }
+        // Let clients balance their next requests without an extra GetLoad call
+        context->AddTrailingMetadata("urlfetcher-queued-fetches", std::to_string(num_queued_fetches()));
         logger->info("RequestFetch finished, returning OK");
         return Status::OK;
     }
 
     Status ResolveFetch(ServerContext* context, ServerReaderWriter<Response, PendingFetch>* stream) override {
         PendingFetch pending_fetch;
+        // Digests of all bodies the client holds, either declared by the client or already sent on this stream
+        std::unordered_set<uint64> client_digests;
         while (stream->Read(&pending_fetch)) {
             logger->info("Reading pending fetch {:d}", pending_fetch.key());
-            // Polling for results from the fetcher thread pool using simple exponential backoff up to approx. 1 min
-            //TODO remove polling by using subqueues from concurrentqueue.h, where queue tokens could be gRPC client id's that are sent with the metadata
-            for (int poll_ms = 2 << 3;
-                 is_fetching_ && result_is_pending(pending_fetch.key());
-                 poll_ms = std::min(2 << 14, poll_ms << 1))
-            {
-                logger->debug("No results for key {:d}, waiting for {:d} ms", pending_fetch.key(), poll_ms);
-                std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
-            }
-            Response response = pop_completed_fetch(pending_fetch.key());
+            bool omit_known_bodies = pending_fetch.omit_known_bodies();
+            if (omit_known_bodies) {
+                client_digests.insert(
+                        pending_fetch.known_body_digests().begin(),
+                        pending_fetch.known_body_digests().end());
+            }
+            Status status;
+            FetchShard* shard = owning_shard(pending_fetch.key(), &status);
+            if (!shard) {
+                return status;
+            }
+            Response response;
+            status = resolve_key(*shard, pending_fetch.key(), omit_known_bodies, client_digests, &response);
+            if (!status.ok()) {
+                return status;
+            }
             stream->Write(response);
         }
         logger->info("ResolveFetch finished, returning OK");
         return Status::OK;
     }
 
-    void StartFetcherThreads() {
-        logger->info("Starting {:d} fetcher threads", fetchers_.size());
-        is_fetching_ = true;
-        for (int i = 0; i < fetchers_.size(); ++i) {
-            if (fetchers_[i].joinable()) {
-                logger->warn("Will not overwrite fetcher thread {:d} with new thread because it is already running", i);
+    Status RequestFetchBatch(ServerContext* context, ServerReaderWriter<PendingFetchBatch, RequestBatch>* stream) override {
+        logger->info("Reading batches of URL fetch requests from stream");
+        FetchShard& shard = choose_shard();
+        uint64 session = ++previous_session_;
+        RequestBatch request_batch;
+        while (stream->Read(&request_batch)) {
+            logger->debug("Got batch of {:d} URLs", request_batch.urls_size());
+            if (request_batch.download_to_file() && !downloads_enabled()) {
+                return download_disabled_status();
             }
-            else {
-                logger->debug("Starting fetcher thread {:d}", i);
-                fetchers_[i] = std::thread(&URLFetcherService::URL_fetch_loop, this);
+            PendingFetchBatch pending_batch;
+            auto keys = shard.submit_fetches(request_batch.urls(), session, request_batch.download_to_file());
+            pending_batch.mutable_keys()->Reserve(keys.size());
+            for (auto key : keys) {
+                pending_batch.add_keys(key);
             }
+            stream->Write(pending_batch);
         }
+        context->AddTrailingMetadata("urlfetcher-queued-fetches", std::to_string(num_queued_fetches()));
+        logger->info("RequestFetchBatch finished, returning OK");
+        return Status::OK;
     }
 
-    void StopFetcherThreads() {
-        logger->info("Stopping {:d} fetcher threads", fetchers_.size());
-        is_fetching_ = false;
-        for (int i = 0; i < fetchers_.size(); ++i) {
-            if (!fetchers_[i].joinable()) {
-                logger->warn("Fetcher thread {:d} is not running, will not join it", i);
+    Status ResolveFetchBatch(ServerContext* context, ServerReaderWriter<ResponseBatch, PendingFetchBatch>* stream) override {
+        PendingFetchBatch pending_batch;
+        std::unordered_set<uint64> client_digests;
+        ResponseBatch response_batch;
+        size_t response_batch_bytes{0};
+        auto write_response_batch = [&] {
+            if (response_batch.responses_size() > 0) {
+                stream->Write(response_batch);
+                response_batch.Clear();
+                response_batch_bytes = 0;
             }
-            else {
-                logger->debug("Stopping fetcher thread {:d}", i);
-                fetchers_[i].join();
+        };
+        while (stream->Read(&pending_batch)) {
+            logger->info("Reading batch of {:d} pending fetches", pending_batch.keys_size());
+            bool omit_known_bodies = pending_batch.omit_known_bodies();
+            if (omit_known_bodies) {
+                client_digests.insert(
+                        pending_batch.known_body_digests().begin(),
+                        pending_batch.known_body_digests().end());
+            }
+            for (auto key : pending_batch.keys()) {
+                Status status;
+                FetchShard* shard = owning_shard(key, &status);
+                // Send the responses bundled so far instead of holding them back while waiting for a pending fetch
+                if (!shard || !shard->is_completed(key)) {
+                    write_response_batch();
+                }
+                if (!shard) {
+                    return status;
+                }
+                Response response;
+                status = resolve_key(*shard, key, omit_known_bodies, client_digests, &response);
+                if (!status.ok()) {
+                    write_response_batch();
+                    return status;
+                }
+                // Keep bundles within RESPONSE_BATCH_MAX_BYTES, a larger response goes in a bundle of its own
+                size_t response_bytes = response.ByteSizeLong();
+                if (response_batch_bytes + response_bytes > RESPONSE_BATCH_MAX_BYTES) {
+                    write_response_batch();
+                }
+                *response_batch.add_responses() = std::move(response);
+                response_batch_bytes += response_bytes;
             }
+            write_response_batch();
         }
+        logger->info("ResolveFetchBatch finished, returning OK");
+        return Status::OK;
     }
 
-private:
-    uint64 create_uuid() {
-        return ++previous_uuid_;
+    Status GetLoad(ServerContext* context, const LoadRequest* request, LoadReport* report) override {
+        size_t completed_fetches{0};
+        size_t num_fetcher_threads{0};
+        for (auto& shard : shards_) {
+            completed_fetches += shard->num_completed_fetches();
+            num_fetcher_threads += shard->num_fetcher_threads();
+        }
+        report->set_replica_id(replica_id_);
+        report->set_queued_fetches(num_queued_fetches());
+        report->set_completed_fetches(completed_fetches);
+        report->set_num_fetcher_threads(num_fetcher_threads);
+        return Status::OK;
     }
 
-    void URL_fetch_loop() {
-        auto wait_on_empty_ms = std::chrono::milliseconds(FETCHER_THREAD_WAIT_ON_EMPTY_MS);
-        while (is_fetching_) {
-            std::pair<uint64, std::string> key_and_url;
-            if (fetch_queue_.wait_dequeue_timed(key_and_url, wait_on_empty_ms)) {
-                auto [key, url] = key_and_url;
-                logger->debug("URL_fetch_loop handling key {:d} url '{:s}'", key, url);
-                Response response{fetch_URL(url)};
-                write_completed_fetch(key, response);
-            }
+    size_t num_queued_fetches() const {
+        size_t queued_fetches{0};
+        for (auto& shard : shards_) {
+            queued_fetches += shard->num_queued_fetches();
         }
+        return queued_fetches;
     }
 
-    bool result_is_pending(uint64 key) {
-        std::unique_lock<std::mutex> guard(queue_mutex_);
-        return completed_fetches_.find(key) == completed_fetches_.end();
+    int num_shards() const {
+        return shards_.size();
     }
 
-    Response pop_completed_fetch(uint64 key) {
-        std::unique_lock<std::mutex> guard(queue_mutex_);
-        auto item = completed_fetches_.find(key);
-        Response response = item->second;
-        completed_fetches_.erase(item);
-        return response;
+    FetchShard& shard(int shard_index) {
+        return *shards_[shard_index];
     }
 
-    void write_completed_fetch(uint64 key, const Response& response) {
-        std::unique_lock<std::mutex> guard(queue_mutex_);
-        if (completed_fetches_.find(key) != completed_fetches_.end()) {
-            logger->warn("Overwriting existing, completed fetch at key {:d}", key);
+    // Round-robin, since the gRPC threads that call it are not pinned and may run on the CPUs of any shard
+    FetchShard& choose_shard() {
+        return *shards_[next_shard_++ % shards_.size()];
+    }
+
+private:
+    bool downloads_enabled() const {
+        return !download_directory_.empty();
+    }
+
+    static Status download_disabled_status() {
+        logger->error("Download to file requested but the server has no download directory");
+        return Status(grpc::StatusCode::FAILED_PRECONDITION, "download to file is not enabled on this server");
+    }
+
+    // Shard that owns key, or nullptr with the reason in status if this server does not own the key
+    FetchShard* owning_shard(uint64 key, Status* status) {
+        if (!is_valid_key(key)) {
+            logger->error("Key {:d} was never returned by any server", key);
+            *status = Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid key");
+            return nullptr;
         }
-        completed_fetches_[key] = response;
+        // Keys encode the replica and shard that own them
+        if (replica_of_key(key) != replica_id_) {
+            logger->error("Key {:d} belongs to replica {:d}, not to this replica {:d}", key, replica_of_key(key), replica_id_);
+            *status = Status(grpc::StatusCode::FAILED_PRECONDITION, "key belongs to another replica");
+            return nullptr;
+        }
+        int shard_index = shard_of_key(key);
+        if (shard_index >= shards_.size()) {
+            logger->error("Key {:d} refers to shard {:d} but there are only {:d} shards", key, shard_index, shards_.size());
+            *status = Status(grpc::StatusCode::INVALID_ARGUMENT, "unknown key");
+            return nullptr;
+        }
+        return shards_[shard_index].get();
     }
 
-    std::atomic<uint64> previous_uuid_{0};
-    std::vector<std::thread> fetchers_;
-    bool is_fetching_;
-    moodycamel::BlockingConcurrentQueue<std::pair<uint64, std::string> > fetch_queue_;
-    std::unordered_map<uint64, Response> completed_fetches_;
-    std::mutex queue_mutex_;
+    // Wait for the fetch at key, omitting its body if the client already holds it
+    Status resolve_key(
+            FetchShard& shard,
+            uint64 key,
+            bool omit_known_bodies,
+            std::unordered_set<uint64>& client_digests,
+            Response* response) {
+        if (!shard.resolve_fetch(key, response, omit_known_bodies ? &client_digests : nullptr)) {
+            logger->warn("Shard {:d} stopped before key {:d} was resolved", shard_of_key(key), key);
+            return Status(grpc::StatusCode::UNAVAILABLE, "server is shutting down");
+        }
+        if (omit_known_bodies && response->curl_error() == CURLE_OK && response->file_path().empty()) {
+            client_digests.insert(response->body_digest());
+        }
+        return Status::OK;
+    }
+
+    int replica_id_;
+    std::string download_directory_;
+    // Declared before shards_, whose fetcher threads write into it until they are joined
+    std::unique_ptr<TrafficTraceWriter> trace_;
+    std::atomic<uint64> previous_session_{0};
+    std::vector<std::unique_ptr<FetchShard> > shards_;
+    std::atomic<unsigned> next_shard_{0};
 };
 
 
-// Wrapper for allowing capture in lambda signal handler
-// https://stackoverflow.com/a/48164204
-// An alternative might be to make the URLFetcherService instance a global variable
+// Replica id from the ordinal at the end of the host name, e.g. 3 for the Kubernetes StatefulSet pod 'urlfetcher-3'.
+// Returns -1 if the host name does not end with an ordinal.
+int replica_id_from_hostname() {
+    char hostname[256]{};
+    if (gethostname(hostname, sizeof(hostname) - 1) != 0) {
+        return -1;
+    }
+    std::string name{hostname};
+    auto ordinal_begin = name.find_last_not_of("0123456789") + 1;
+    if (ordinal_begin >= name.size() || name.size() - ordinal_begin > 9) {
+        return -1;
+    }
+    return std::stoi(name.substr(ordinal_begin));
+}
+
+
+// Shuts down the server of the running run_forever, given the signal that asked for it.
+// Called on SIGINT and SIGTERM, never from within a signal handler, and may also be called directly.
 std::function<void(int)> shutdown_handler;
-void signal_handler(int signal) { shutdown_handler(signal); }
 
-void run_forever(const std::string& address, int num_fetcher_threads = NUM_FETCH_THREADS) {
+// Thread of the running run_forever that takes SIGINT and SIGTERM with sigwait, valid while has_shutdown_signal_waiter
+pthread_t shutdown_signal_waiter;
+std::atomic<bool> has_shutdown_signal_waiter{false};
+
+// Signal handler for threads that do not block SIGINT and SIGTERM, e.g. those the caller started before run_forever.
+// Only passes the signal on to the waiting thread, since pthread_kill is async-signal-safe.
+void forward_shutdown_signal(int signal) {
+    if (has_shutdown_signal_waiter) {
+        pthread_kill(shutdown_signal_waiter, signal);
+    }
+}
+
+void run_forever(const std::string& address, const ServerOptions& options) {
+    // SIGINT and SIGTERM are blocked in this thread and in all threads started by the server,
+    // and taken with sigwait on a thread of their own instead.
+    // Shutting down from within a signal handler that interrupted server->Wait() deadlocks,
+    // and the service must be destroyed normally so that e.g. a traffic trace is flushed.
+    sigset_t shutdown_signals, previous_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &previous_signals);
     ServerBuilder builder;
     builder.AddListeningPort(address, grpc::InsecureServerCredentials());
-    URLFetcherService service(num_fetcher_threads);
+    URLFetcherService service(options);
+    // One gRPC completion queue per shard
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS, service.num_shards());
     builder.RegisterService(&service);
     std::unique_ptr<Server> server(builder.BuildAndStart());
     logger->info("Server listening on '{:s}'", address);
-    // Allow parent process to terminate the server gracefully with a SIGTERM or SIGINT
-    std::signal(SIGINT, signal_handler);
-    std::signal(SIGTERM, signal_handler);
     shutdown_handler = [&server](int signal) -> void {
         logger->info("Received signal {:d}, server shutting down", signal);
         server->Shutdown();
     };
+    std::atomic<bool> is_serving{true};
+    // Allow parent process to terminate the server gracefully with a SIGTERM or SIGINT
+    std::thread signal_waiter([&shutdown_signals, &is_serving] {
+        int signal;
+        sigwait(&shutdown_signals, &signal);
+        if (is_serving) {
+            shutdown_handler(signal);
+        }
+    });
+    shutdown_signal_waiter = signal_waiter.native_handle();
+    has_shutdown_signal_waiter = true;
+    struct sigaction forward{}, previous_sigint{}, previous_sigterm{};
+    forward.sa_handler = forward_shutdown_signal;
+    sigemptyset(&forward.sa_mask);
+    sigaction(SIGINT, &forward, &previous_sigint);
+    sigaction(SIGTERM, &forward, &previous_sigterm);
     server->Wait();
+    // Signals arriving from here on are dropped by the handler until the previous handlers are back
+    is_serving = false;
+    has_shutdown_signal_waiter = false;
+    // Wake up the signal waiter if the server was shut down by calling shutdown_handler directly
+    pthread_kill(signal_waiter.native_handle(), SIGTERM);
+    signal_waiter.join();
+    sigaction(SIGINT, &previous_sigint, nullptr);
+    sigaction(SIGTERM, &previous_sigterm, nullptr);
+    pthread_sigmask(SIG_SETMASK, &previous_signals, nullptr);
+}
+
+void run_forever(const std::string& address, int num_fetcher_threads = NUM_FETCH_THREADS) {
+    run_forever(address, ServerOptions{num_fetcher_threads});
 }
 
 } // namespace urlfetcher
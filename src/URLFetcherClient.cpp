@@ -1,26 +1,55 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
-#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cxxopts/cxxopts.hpp>
-#include "URLFetcherClient.hpp"
+#include <fmt/format.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/util/delimited_message_util.h>
+#include <spdlog/sinks/stdout_sinks.h>
+#include "BulkFetch.hpp"
 
+using urlfetcher::FetchRecord;
 using urlfetcher::Response;
-using urlfetcher::client::URLFetcherClient;
+using urlfetcher::client::BulkFetcher;
+using urlfetcher::client::BulkFetchSummary;
+using urlfetcher::client::DEFAULT_BULK_FETCH_WINDOW;
 using urlfetcher::client::logger;
-using urlfetcher::client::uint64;
 
 
 decltype(auto) parse_args_or_exit(int argc, char** argv) {
-    cxxopts::Options options("URLFetcherClient", "Client for URLFetcherServer.");
+    cxxopts::Options options(
+            "URLFetcherClient",
+            "Client for URLFetcherServer. Fetches a stream of URLs, one per line, with a fixed number of fetches outstanding "
+            "and writes each result as soon as it arrives, so memory use does not grow with the number of URLs. "
+            "Ends with a throughput and latency summary on stderr.");
     options.add_options()
         ("h,help",
          "Print this message and exit")
         ("v,verbose",
          "Increase logging verbosity by each given -v up to 2. 0 = warning, 1 = info, 2 = debug")
         ("a,address",
-         "gRPC serving address, establish connection to this server.",
-         cxxopts::value<std::string>()->default_value("localhost:8000"))
+         "gRPC serving address, establish connection to this server. "
+         "Give several comma separated addresses to spread the fetches over replicas of the service.",
+         cxxopts::value<std::vector<std::string> >()->default_value("localhost:8000"))
+        ("i,input",
+         "File with one URL per line, '-' for stdin",
+         cxxopts::value<std::string>()->default_value("-"))
+        ("o,output",
+         "File to write the results into, '-' for stdout",
+         cxxopts::value<std::string>()->default_value("-"))
+        ("f,format",
+         "Format of the results: 'ndjson' writes one JSON object per line, "
+         "'length-prefixed' writes varint length-delimited FetchRecord protobuf messages, "
+         "'none' writes nothing and only prints the summary",
+         cxxopts::value<std::string>()->default_value("ndjson"))
+        ("w,window",
+         "Number of fetches to keep outstanding, split evenly between the servers, at least one per server",
+         cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_BULK_FETCH_WINDOW)))
+        ("download-to-file",
+         "Ask the servers to write the bodies into their download directory and return only the file path, size and digest")
         ;
     auto args = options.parse(argc, argv);
     if (args.count("help")) {
@@ -45,33 +74,149 @@ decltype(auto) parse_args_or_exit(int argc, char** argv) {
     return args;
 }
 
+
+// Escape bytes for a JSON string.
+// Bodies need not be UTF-8, so bytes from 0x80 up are written as \u0080 to \u00ff, i.e. each code point is one byte of the input.
+void append_json_string(std::string& out, const std::string& bytes) {
+    out += '"';
+    for (unsigned char c : bytes) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (c < 0x20 || c >= 0x80) {
+                    out += fmt::format("\\u{:04x}", c);
+                }
+                else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    out += '"';
+}
+
+void write_ndjson(std::ostream& out, const FetchRecord& record, std::string& line) {
+    const Response& response = record.response();
+    line.clear();
+    line += fmt::format("{{\"index\":{:d},\"url\":", record.index());
+    append_json_string(line, record.url());
+    line += fmt::format(",\"latency_us\":{:d},\"curl_error\":{:d},\"http_status\":{:d},\"body_digest\":\"{:016x}\"",
+            record.latency_us(), response.curl_error(), response.http_status(), response.body_digest());
+    if (!response.file_path().empty()) {
+        line += ",\"file_path\":";
+        append_json_string(line, response.file_path());
+        line += fmt::format(",\"file_size\":{:d}", response.file_size());
+    }
+    line += ",\"header\":";
+    append_json_string(line, response.header());
+    line += ",\"body\":";
+    append_json_string(line, response.body());
+    line += "}\n";
+    out.write(line.data(), line.size());
+}
+
+void print_summary(const BulkFetchSummary& summary) {
+    double seconds = summary.elapsed.count();
+    const auto& latencies = summary.latencies_us;
+    std::cerr
+        << "Resolved " << summary.num_resolved << " fetches in " << seconds << " s"
+        << ", " << (seconds > 0 ? summary.num_resolved / seconds : 0) << " fetches/s"
+        << ", " << (seconds > 0 ? summary.body_bytes / seconds / (1 << 20) : 0) << " MiB/s of bodies\n"
+        << "Failed or unresolved fetches: " << summary.num_failed << "\n"
+        << "Latency from request to response (us):"
+        << " p50 " << latencies.percentile(0.5)
+        << " p90 " << latencies.percentile(0.9)
+        << " p99 " << latencies.percentile(0.99)
+        << " max " << latencies.max()
+        << "\n";
+}
+
 int main(int argc, char** argv) {
     auto args = parse_args_or_exit(argc, argv);
-    std::string grpc_address = args["address"].as<std::string>();
-    std::vector<std::string> urls = {
-        "https://matiaslindgren.github.io/",
-        "https://httpstat.us/200",
-        "https://httpstat.us/308",
-        "https://httpstat.us/404",
-        "https://yle.fi",
+    // Results may go to stdout, keep the log out of them
+    logger->sinks().clear();
+    logger->sinks().push_back(std::make_shared<spdlog::sinks::stderr_sink_mt>());
+    std::ios::sync_with_stdio(false);
+
+    std::string format = args["format"].as<std::string>();
+    if (format != "ndjson" && format != "length-prefixed" && format != "none") {
+        std::cerr << "Unknown format '" << format << "'\n";
+        return 1;
+    }
+    auto addresses = args["address"].as<std::vector<std::string> >();
+    size_t window = args["window"].as<size_t>();
+    // Every server needs room for at least one outstanding fetch
+    if (window < std::max<size_t>(1, addresses.size())) {
+        std::cerr << "Window must be at least the number of servers, " << std::max<size_t>(1, addresses.size()) << "\n";
+        return 1;
+    }
+
+    std::string input_path = args["input"].as<std::string>();
+    std::ifstream input_file;
+    if (input_path != "-") {
+        input_file.open(input_path);
+        if (!input_file.is_open()) {
+            std::cerr << "Cannot open input '" << input_path << "'\n";
+            return 1;
+        }
+    }
+    std::istream& input = input_path == "-" ? std::cin : input_file;
+    std::string output_path = args["output"].as<std::string>();
+    std::ofstream output_file;
+    if (output_path != "-") {
+        output_file.open(output_path, std::ios::binary | std::ios::trunc);
+        if (!output_file.is_open()) {
+            std::cerr << "Cannot open output '" << output_path << "'\n";
+            return 1;
+        }
+    }
+    std::ostream& output = output_path == "-" ? std::cout : output_file;
+
+    // Skips empty lines and trailing carriage returns
+    auto next_url = [&input](std::string* url) {
+        while (std::getline(input, *url)) {
+            if (!url->empty() && url->back() == '\r') {
+                url->pop_back();
+            }
+            if (!url->empty()) {
+                return true;
+            }
+        }
+        return false;
     };
-    URLFetcherClient fetcher{grpc_address};
-    // Request a fetch of URLs, this call resolves immediately, returning a list of keys
-    std::vector<uint64> keys = fetcher.request_fetches(urls);
-    std::cout << "Pending fetch UUIDs returned by the server:\n";
-    std::copy(keys.begin(), keys.end(), std::ostream_iterator<uint64>(std::cout, " "));
-    std::cout << "\n";
-    // The server passes all URLs to its thread pool, which starts to fetch them with cURL
-    // We can ask for the resolved requests by passing the UUIDs returned by the server
-    std::vector<Response> responses = fetcher.resolve_fetches(keys);
-    std::cout << "Resolved URL requests returned by the server:\n";
-    for (int i = 0; i < urls.size(); ++i) {
-        std::cout
-            << urls[i]
-            << ", header size " << responses[i].header().size()
-            << ", body size " << responses[i].body().size()
-            << ", error code " << responses[i].curl_error()
-            << "\n";
+
+    BulkFetcher fetcher(addresses, window, args.count("download-to-file") > 0);
+    BulkFetchSummary summary;
+    if (format == "length-prefixed") {
+        google::protobuf::io::OstreamOutputStream record_output(&output);
+        summary = fetcher.run(next_url, [&record_output](FetchRecord& record) {
+            google::protobuf::util::SerializeDelimitedToZeroCopyStream(record, &record_output);
+        });
+    }
+    else if (format == "ndjson") {
+        std::string line;
+        summary = fetcher.run(next_url, [&output, &line](FetchRecord& record) {
+            write_ndjson(output, record, line);
+        });
+    }
+    else {
+        summary = fetcher.run(next_url, [](FetchRecord&) {});
     }
-    return 0;
+    output.flush();
+    print_summary(summary);
+    return summary.num_failed == 0 ? 0 : 2;
 }
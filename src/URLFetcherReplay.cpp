@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cxxopts/cxxopts.hpp>
+#include "ReplayUpstream.hpp"
+#include "TrafficTrace.hpp"
+#include "URLFetcherClient.hpp"
+
+using urlfetcher::PendingFetch;
+using urlfetcher::ReplayUpstream;
+using urlfetcher::Request;
+using urlfetcher::Response;
+using urlfetcher::TraceRecord;
+using urlfetcher::TrafficTraceReader;
+using urlfetcher::URLFetcher;
+using urlfetcher::client::logger;
+using urlfetcher::client::uint64;
+using urlfetcher::replay_url;
+using Clock = std::chrono::steady_clock;
+
+
+decltype(auto) parse_args_or_exit(int argc, char** argv) {
+    cxxopts::Options options(
+            "URLFetcherReplay",
+            "Replay a traffic trace recorded by URLFetcherServer --trace against a server, "
+            "with a local stand-in upstream that reproduces the recorded latencies, body sizes and statuses. "
+            "The server must run on this host to reach the stand-in upstream.");
+    options.add_options()
+        ("h,help",
+         "Print this message and exit")
+        ("v,verbose",
+         "Increase logging verbosity by each given -v up to 2. 0 = warning, 1 = info, 2 = debug")
+        ("a,address",
+         "gRPC serving address of the server to replay the trace against",
+         cxxopts::value<std::string>()->default_value("localhost:8000"))
+        ("t,trace",
+         "Traffic trace file to replay",
+         cxxopts::value<std::string>())
+        ("s,speed",
+         "Replay this many times faster than recorded, both the arrivals and the upstream latencies",
+         cxxopts::value<double>()->default_value("1"))
+        ("upstream-port",
+         "Port of the stand-in upstream on 127.0.0.1, by default a free port",
+         cxxopts::value<int>()->default_value("0"))
+        ;
+    auto args = options.parse(argc, argv);
+    if (args.count("help")) {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+    if (!args.count("trace")) {
+        std::cerr << "No trace given, see --help\n";
+        exit(1);
+    }
+    switch (args.count("verbose")) {
+        case 0:
+            logger->set_level(spdlog::level::warn);
+            break;
+        case 1:
+            logger->set_level(spdlog::level::info);
+            break;
+        case 2:
+            logger->set_level(spdlog::level::debug);
+            break;
+        default:
+            std::cerr << "Unknown verbosity level " << args.count("verbose") << "\n";
+            exit(1);
+            break;
+    }
+    return args;
+}
+
+
+struct ReplayResults {
+    size_t num_fetches{0};
+    // Fetches whose status or body size differs from the recorded one
+    size_t num_mismatches{0};
+    // Microseconds from the replayed arrival of each URL until its response was received
+    std::vector<uint64> latencies_us;
+    std::mutex mutex;
+};
+
+bool matches_record(const Response& response, const TraceRecord& record) {
+    if (record.http_status() == 0) {
+        return response.curl_error() != 0;
+    }
+    return response.curl_error() == 0
+        && response.http_status() == record.http_status()
+        && response.body().size() == record.body_size();
+}
+
+// Replay one recorded RequestFetch stream: write each URL at its recorded arrival time, scaled by speed,
+// and resolve the keys on a ResolveFetch stream as soon as they arrive, while the session is still sending
+void replay_session(
+        URLFetcher::Stub& stub,
+        const std::vector<TraceRecord>& records,
+        const std::string& upstream_address,
+        Clock::time_point start,
+        double speed,
+        ReplayResults& results) {
+    auto arrival_of = [start, speed](const TraceRecord& record) {
+        return start + std::chrono::microseconds(static_cast<uint64>(record.arrival_us() / speed));
+    };
+    grpc::ClientContext request_context;
+    grpc::ClientContext resolve_context;
+    auto requests = stub.RequestFetch(&request_context);
+    auto resolves = stub.ResolveFetch(&resolve_context);
+    std::thread key_forwarder([&requests, &resolves] {
+        PendingFetch pending_fetch;
+        while (requests->Read(&pending_fetch)) {
+            resolves->Write(pending_fetch);
+        }
+        resolves->WritesDone();
+    });
+    // Responses arrive in the order of the keys, which is the order of the records
+    std::vector<uint64> latencies_us;
+    size_t num_mismatches{0};
+    std::thread response_reader([&] {
+        Response response;
+        for (size_t i = 0; resolves->Read(&response); ++i) {
+            if (i >= records.size()) {
+                logger->error("Server returned more responses than the session has records");
+                continue;
+            }
+            auto latency = Clock::now() - arrival_of(records[i]);
+            latencies_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+            if (!matches_record(response, records[i])) {
+                logger->info("Replayed '{:s}' got status {:d} and {:d} bytes, recorded status {:d} and {:d} bytes",
+                        records[i].url(), response.http_status(), response.body().size(),
+                        records[i].http_status(), records[i].body_size());
+                ++num_mismatches;
+            }
+        }
+    });
+    for (const auto& record : records) {
+        std::this_thread::sleep_until(arrival_of(record));
+        Request request;
+        request.set_url(replay_url(record, upstream_address));
+        if (!requests->Write(request)) {
+            break;
+        }
+    }
+    requests->WritesDone();
+    key_forwarder.join();
+    grpc::Status status = requests->Finish();
+    if (!status.ok()) {
+        logger->error("RequestFetch failed during replay: {:s}", status.error_message());
+    }
+    response_reader.join();
+    status = resolves->Finish();
+    if (!status.ok()) {
+        logger->error("ResolveFetch failed during replay: {:s}", status.error_message());
+    }
+    std::unique_lock<std::mutex> guard(results.mutex);
+    results.num_fetches += records.size();
+    // Fetches that were never resolved count as mismatches
+    results.num_mismatches += num_mismatches + records.size() - latencies_us.size();
+    results.latencies_us.insert(results.latencies_us.end(), latencies_us.begin(), latencies_us.end());
+}
+
+uint64 percentile(const std::vector<uint64>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_args_or_exit(argc, argv);
+    std::string trace_path = args["trace"].as<std::string>();
+    double speed = args["speed"].as<double>();
+    if (speed <= 0) {
+        std::cerr << "Speed must be positive\n";
+        return 1;
+    }
+    TrafficTraceReader trace(trace_path);
+    if (!trace.is_open()) {
+        std::cerr << "Cannot open trace '" << trace_path << "'\n";
+        return 1;
+    }
+    // Records of each session in arrival order
+    std::map<uint64, std::vector<TraceRecord> > sessions;
+    TraceRecord record;
+    while (trace.next(&record)) {
+        sessions[record.session()].push_back(record);
+    }
+    for (auto& [session, records] : sessions) {
+        std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+            return a.arrival_us() < b.arrival_us();
+        });
+    }
+    ReplayUpstream upstream(args["upstream-port"].as<int>(), speed);
+    if (!upstream.is_listening()) {
+        std::cerr << "Cannot start the stand-in upstream\n";
+        return 1;
+    }
+    logger->info("Replaying {:d} sessions from '{:s}' with upstream at {:s}", sessions.size(), trace_path, upstream.address());
+
+    auto channel = grpc::CreateChannel(args["address"].as<std::string>(), grpc::InsecureChannelCredentials());
+    auto stub = URLFetcher::NewStub(channel);
+    ReplayResults results;
+    std::vector<std::thread> session_threads;
+    auto start = Clock::now();
+    for (const auto& [session, records] : sessions) {
+        session_threads.emplace_back([&, &records = records] {
+            replay_session(*stub, records, upstream.address(), start, speed, results);
+        });
+    }
+    for (auto& thread : session_threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::sort(results.latencies_us.begin(), results.latencies_us.end());
+    std::cout
+        << "Replayed " << results.num_fetches << " fetches in " << sessions.size() << " sessions"
+        << " in " << elapsed.count() << " s at " << speed << "x speed"
+        << ", " << results.num_fetches / elapsed.count() << " fetches/s\n"
+        << "Mismatching or failed fetches: " << results.num_mismatches << "\n"
+        << "Latency from arrival to response (us):"
+        << " p50 " << percentile(results.latencies_us, 0.5)
+        << " p90 " << percentile(results.latencies_us, 0.9)
+        << " p99 " << percentile(results.latencies_us, 0.99)
+        << " max " << (results.latencies_us.empty() ? 0 : results.latencies_us.back())
+        << "\n";
+    return results.num_mismatches == 0 ? 0 : 2;
+}
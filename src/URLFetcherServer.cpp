@@ -3,8 +3,12 @@
 #include <cxxopts/cxxopts.hpp>
 #include "URLFetcherServer.hpp"
 
+using urlfetcher::MAX_NUM_REPLICAS;
+using urlfetcher::server::FileSyncMode;
 using urlfetcher::server::logger;
+using urlfetcher::server::replica_id_from_hostname;
 using urlfetcher::server::run_forever;
+using urlfetcher::server::ServerOptions;
 
 
 decltype(auto) parse_args_or_exit(int argc, char** argv) {
@@ -20,7 +24,30 @@ decltype(auto) parse_args_or_exit(int argc, char** argv) {
          "gRPC serving address, clients should connect to this",
          cxxopts::value<std::string>()->default_value("localhost:8000"))
         ("t,threads",
-         "Number of concurrent threads to spawn for fetching requested URLs")
+         "Number of concurrent threads to spawn for fetching requested URLs, in each shard",
+         cxxopts::value<int>())
+        ("s,shards",
+         "Split the service into this many shards, each with its own fetch queue, fetcher threads and completed fetches",
+         cxxopts::value<int>()->default_value("1"))
+        ("pin-threads",
+         "Pin the fetcher threads of each shard to its own set of CPUs, chosen NUMA node by node")
+        ("r,replica-id",
+         "Id of this server among all replicas of the service, from 0 to 255, encoded into every key. "
+         "Use 'hostname' to take it from the ordinal at the end of the host name, e.g. a StatefulSet pod name",
+         cxxopts::value<std::string>()->default_value("0"))
+        ("trace",
+         "Record a traffic trace of all fetches into this file, which URLFetcherReplay can play back",
+         cxxopts::value<std::string>())
+        ("download-dir",
+         "Allow clients to request that bodies are written into files in this directory instead of returned",
+         cxxopts::value<std::string>())
+        ("preallocate",
+         "Preallocate each downloaded file from the Content-Length of its response")
+        ("download-sync",
+         "How downloaded files are written: 'none' leaves them to the page cache, "
+         "'sync_file_range' writes them back and drops them from the page cache as they grow, "
+         "'direct' bypasses the page cache with O_DIRECT",
+         cxxopts::value<std::string>()->default_value("none"))
         ;
     auto args = options.parse(argc, argv);
     if (args.count("help")) {
@@ -48,11 +75,48 @@ decltype(auto) parse_args_or_exit(int argc, char** argv) {
 int main(int argc, char** argv) {
     auto args = parse_args_or_exit(argc, argv);
     std::string server_address = args["address"].as<std::string>();
+    ServerOptions options;
     if (args.count("threads")) {
-        run_forever(server_address, args["threads"].as<int>());
+        options.num_fetcher_threads = args["threads"].as<int>();
+    }
+    options.num_shards = args["shards"].as<int>();
+    options.pin_threads = args.count("pin-threads") > 0;
+    std::string replica_id = args["replica-id"].as<std::string>();
+    try {
+        options.replica_id = replica_id == "hostname" ? replica_id_from_hostname() : std::stoi(replica_id);
+    }
+    catch (const std::exception&) {
+        options.replica_id = -1;
+    }
+    if (options.replica_id < 0) {
+        std::cerr << "Could not determine replica id from '" << replica_id << "'\n";
+        return 1;
+    }
+    if (options.replica_id >= MAX_NUM_REPLICAS) {
+        std::cerr << "Replica id " << options.replica_id << " from '" << replica_id << "' must be less than " << MAX_NUM_REPLICAS << "\n";
+        return 1;
+    }
+    if (args.count("trace")) {
+        options.trace_path = args["trace"].as<std::string>();
+    }
+    if (args.count("download-dir")) {
+        options.download.directory = args["download-dir"].as<std::string>();
+    }
+    options.download.preallocate = args.count("preallocate") > 0;
+    std::string download_sync = args["download-sync"].as<std::string>();
+    if (download_sync == "none") {
+        options.download.sync = FileSyncMode::none;
+    }
+    else if (download_sync == "sync_file_range") {
+        options.download.sync = FileSyncMode::sync_file_range;
+    }
+    else if (download_sync == "direct") {
+        options.download.sync = FileSyncMode::direct;
     }
     else {
-        run_forever(server_address);
+        std::cerr << "Unknown download sync mode '" << download_sync << "'\n";
+        return 1;
     }
+    run_forever(server_address, options);
     return 0;
 }
@@ -1,11 +1,21 @@
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <csignal>
 #include <cstdlib>
+#include <cstdio>
+#include <fstream>
 #include <iterator>
+#include <map>
 #include <numeric>
+#include <stdexcept>
 #include <string>
 #include <thread>
 
+#include "BulkFetch.hpp"
+#include "FakeFetchBackend.hpp"
+#include "ReplayUpstream.hpp"
+#include "TrafficTrace.hpp"
 #include "URLFetcherClient.hpp"
 #include "URLFetcherServer.hpp"
 
@@ -24,6 +34,8 @@ const std::string http_echo_service_address{
     getenv_or_default("URLFETCHER_ECHO_SERVICE_ADDRESS", "localhost:7000")};
 const std::string grpc_test_address{
     getenv_or_default("URLFETCHER_GRPC_TEST_ADDRESS", "localhost:8000")};
+const std::string grpc_test_address_replica{
+    getenv_or_default("URLFETCHER_GRPC_TEST_ADDRESS_REPLICA", "localhost:8001")};
 const auto test_loglevel{spdlog::level::warn};
 
 constexpr const char* external_urls[]{
@@ -107,6 +119,14 @@ TEST_CASE("Server terminates on SIGINT and SIGTERM", "[server]") {
         server_runner.join();
         REQUIRE(true);
     }
+    // Signals delivered to a thread that does not block them, like this one, are forwarded to the server
+    for (auto signal : {SIGINT, SIGTERM}) {
+        std::thread server_runner([] { run_forever(grpc_test_address); });
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::raise(signal);
+        server_runner.join();
+        REQUIRE(true);
+    }
 }
 
 TEST_CASE("Server returns monotonically increasing UUIDs for request_fetches", "[request-fetches]") {
@@ -331,3 +351,557 @@ TEST_CASE("Server returns resolved URLs when requested with the UUIDs from reque
     server_runner.join();
     REQUIRE(true);
 }
+
+TEST_CASE("BodyHasher computes XXH64 digests independently of how the input is chunked", "[body-hasher]") {
+    using urlfetcher::server::BodyHasher;
+    REQUIRE(BodyHasher::digest_of("") == 0xef46db3751d8e999ULL);
+    REQUIRE(BodyHasher::digest_of("a") == 0xd24ec4f1a98c6e5bULL);
+    REQUIRE(BodyHasher::digest_of("abc") == 0x44bc2cf5ad770999ULL);
+    REQUIRE(BodyHasher::digest_of("Nobody inspects the spammish repetition") == 0xfbcea83c8a378bf1ULL);
+    std::string data(10'000, '\0');
+    std::iota(data.begin(), data.end(), 0);
+    for (size_t chunk_size : {1, 3, 31, 32, 33, 1000}) {
+        BodyHasher hasher;
+        for (size_t begin = 0; begin < data.size(); begin += chunk_size) {
+            hasher.update(data.data() + begin, std::min(chunk_size, data.size() - begin));
+        }
+        REQUIRE(hasher.digest() == BodyHasher::digest_of(data));
+    }
+}
+
+TEST_CASE("BodyStore keeps one copy of each distinct body until all references are released", "[body-store]") {
+    using urlfetcher::server::BodyHasher;
+    using urlfetcher::server::BodyStore;
+    BodyStore store;
+    const std::string body{"duplicate payload"};
+    const auto digest = BodyHasher::digest_of(body);
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(store.acquire(digest, std::string(body)));
+    }
+    REQUIRE(store.num_bodies() == 1);
+    REQUIRE(store.num_references(digest) == 3);
+    REQUIRE(store.get(digest) == body);
+    // A different payload with a colliding digest is rejected and left to the caller
+    REQUIRE(!store.acquire(digest, std::string("other payload")));
+    REQUIRE(store.num_references(digest) == 3);
+    for (int i = 0; i < 3; ++i) {
+        store.release(digest);
+    }
+    REQUIRE(store.num_bodies() == 0);
+}
+
+TEST_CASE("Server omits duplicate bodies when requested and the client fills them in", "[resolve-fetches-omit-bodies]") {
+    using urlfetcher::server::BodyHasher;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    std::thread server_runner([] { run_forever(grpc_test_address); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    // Echo URLs with only a few distinct routes, i.e. many byte-identical bodies
+    std::vector<std::string> urls;
+    for (int i = 0; i < 100; ++i) {
+        urls.push_back(fmt::format("{:s}/echo/{:d}", http_echo_service_address, i % 5));
+    }
+    URLFetcherClient fetcher(grpc_test_address);
+    auto responses = fetcher.resolve_fetches(fetcher.request_fetches(urls), true);
+    REQUIRE(responses.size() == urls.size());
+    for (int i = 0; i < urls.size(); ++i) {
+        REQUIRE(responses[i].curl_error() == 0);
+        REQUIRE(!responses[i].body_omitted());
+        REQUIRE(responses[i].body() == std::to_string(i % 5));
+        REQUIRE(responses[i].body_digest() == BodyHasher::digest_of(responses[i].body()));
+    }
+    // Bodies the client declares it already holds are not sent at all
+    std::vector<urlfetcher::client::uint64> known_digests{BodyHasher::digest_of("0"), BodyHasher::digest_of("1")};
+    responses = fetcher.resolve_fetches(fetcher.request_fetches(urls), true, known_digests);
+    REQUIRE(responses.size() == urls.size());
+    for (int i = 0; i < urls.size(); ++i) {
+        REQUIRE(responses[i].curl_error() == 0);
+        if (i % 5 < 2) {
+            REQUIRE(responses[i].body_omitted());
+            REQUIRE(responses[i].body().empty());
+        }
+        else {
+            REQUIRE(responses[i].body() == std::to_string(i % 5));
+        }
+    }
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+    REQUIRE(true);
+}
+
+TEST_CASE("Keys encode the shard that owns them and sharded servers resolve URLs correctly", "[sharded-server]") {
+    using urlfetcher::server::make_key;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shard_of_key;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    REQUIRE(make_key(0, 123) == 123);
+    REQUIRE(shard_of_key(make_key(0, 123)) == 0);
+    REQUIRE(shard_of_key(make_key(7, 123)) == 7);
+    REQUIRE(shard_of_key(make_key(255, 1)) == 255);
+    for (bool pin_threads : {false, true}) {
+        ServerOptions options;
+        options.num_shards = 4;
+        options.num_fetcher_threads = 2;
+        options.pin_threads = pin_threads;
+        std::thread server_runner([&options] { run_forever(grpc_test_address, options); });
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        for (int stream = 0; stream < 8; ++stream) {
+            std::vector<std::string> urls = generate_localhost_echo_urls(100);
+            URLFetcherClient fetcher(grpc_test_address);
+            auto keys = fetcher.request_fetches(urls);
+            REQUIRE(keys.size() == urls.size());
+            // All keys of one stream come from the same shard and are ordered
+            REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+            REQUIRE(shard_of_key(keys.front()) == shard_of_key(keys.back()));
+            REQUIRE(shard_of_key(keys.front()) < options.num_shards);
+            auto responses = fetcher.resolve_fetches(keys);
+            REQUIRE(responses.size() == urls.size());
+            for (int i = 0; i < urls.size(); ++i) {
+                REQUIRE(responses[i].curl_error() == 0);
+                REQUIRE(responses[i].body() == urls[i].substr(urls[i].rfind("/") + 1));
+            }
+        }
+        shutdown_handler(SIGTERM);
+        server_runner.join();
+    }
+    REQUIRE(true);
+}
+
+TEST_CASE("Client spreads fetches over replicas and resolves every key at the replica that owns it", "[replicas]") {
+    using urlfetcher::replica_of_key;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::server::URLFetcherService;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    const std::vector<std::string> addresses{grpc_test_address, grpc_test_address_replica};
+    std::vector<std::unique_ptr<URLFetcherService> > services;
+    std::vector<std::unique_ptr<grpc::Server> > servers;
+    for (int replica_id = 0; replica_id < addresses.size(); ++replica_id) {
+        ServerOptions options;
+        options.replica_id = replica_id;
+        services.push_back(std::make_unique<URLFetcherService>(options));
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(addresses[replica_id], grpc::InsecureServerCredentials());
+        builder.RegisterService(services.back().get());
+        servers.push_back(builder.BuildAndStart());
+        REQUIRE(servers.back());
+    }
+    // Replica ids that do not fit into keys are refused instead of wrapped around
+    for (int replica_id : {-1, urlfetcher::MAX_NUM_REPLICAS}) {
+        ServerOptions options;
+        options.replica_id = replica_id;
+        REQUIRE_THROWS_AS(URLFetcherService(options), std::invalid_argument);
+    }
+    REQUIRE(urlfetcher::make_key(2, 3, 1) != urlfetcher::make_key(2, 3, 0));
+    REQUIRE(replica_of_key(urlfetcher::make_key(2, 3, 1)) == 1);
+    REQUIRE(urlfetcher::shard_of_key(urlfetcher::make_key(2, 3, 1)) == 2);
+    std::vector<std::string> urls = generate_localhost_echo_urls(1000);
+    URLFetcherClient fetcher(addresses);
+    auto keys = fetcher.request_fetches(urls);
+    REQUIRE(keys.size() == urls.size());
+    std::vector<int> keys_per_replica(addresses.size());
+    for (auto key : keys) {
+        REQUIRE(replica_of_key(key) < addresses.size());
+        ++keys_per_replica[replica_of_key(key)];
+    }
+    // Both replicas were idle, so they should get about the same amount of work
+    for (auto num_keys : keys_per_replica) {
+        REQUIRE(num_keys > urls.size() / 4);
+    }
+    auto responses = fetcher.resolve_fetches(keys);
+    REQUIRE(responses.size() == urls.size());
+    for (int i = 0; i < urls.size(); ++i) {
+        REQUIRE(responses[i].curl_error() == 0);
+        REQUIRE(responses[i].body() == urls[i].substr(urls[i].rfind("/") + 1));
+    }
+    // A replica refuses to resolve keys owned by another replica
+    URLFetcherClient replica_0(grpc_test_address);
+    URLFetcherClient replica_1(grpc_test_address_replica);
+    auto replica_1_keys = replica_1.request_fetches(generate_localhost_echo_urls(1));
+    REQUIRE(replica_1_keys.size() == 1);
+    auto refused = replica_0.resolve_fetches(replica_1_keys);
+    REQUIRE(refused.size() == 1);
+    REQUIRE(refused[0].curl_error() == urlfetcher::client::UNRESOLVED_FETCH_ERROR);
+    REQUIRE(replica_1.resolve_fetches(replica_1_keys).size() == 1);
+    // The key 0 of a failed request is never resolved, neither alone nor among valid keys
+    auto mixed_keys = replica_1.request_fetches(generate_localhost_echo_urls(2));
+    mixed_keys.insert(mixed_keys.begin() + 1, 0);
+    auto mixed = replica_1.resolve_fetches_in_batches(mixed_keys);
+    REQUIRE(mixed.size() == 3);
+    REQUIRE(mixed[0].curl_error() == 0);
+    REQUIRE(mixed[1].curl_error() == urlfetcher::client::UNRESOLVED_FETCH_ERROR);
+    REQUIRE(mixed[2].curl_error() == 0);
+    // Unreachable replicas and addresses reporting the replica id of an earlier address get no fetches
+    URLFetcherClient misconfigured({grpc_test_address, "localhost:1", grpc_test_address});
+    auto misconfigured_keys = misconfigured.request_fetches(urls);
+    REQUIRE(misconfigured_keys.size() == urls.size());
+    for (auto key : misconfigured_keys) {
+        REQUIRE(replica_of_key(key) == 0);
+    }
+    for (const auto& response : misconfigured.resolve_fetches(misconfigured_keys)) {
+        REQUIRE(response.curl_error() == 0);
+    }
+    // Keys of a replica the client does not know are not resolved, the others still are
+    auto unknown_keys = misconfigured.request_fetches(generate_localhost_echo_urls(2));
+    unknown_keys.insert(unknown_keys.begin() + 1, replica_1.request_fetches(generate_localhost_echo_urls(1)).at(0));
+    auto unknown = misconfigured.resolve_fetches(unknown_keys);
+    REQUIRE(unknown.size() == 3);
+    REQUIRE(unknown[0].curl_error() == 0);
+    REQUIRE(unknown[1].curl_error() == urlfetcher::client::UNRESOLVED_FETCH_ERROR);
+    REQUIRE(unknown[2].curl_error() == 0);
+    for (auto& server : servers) {
+        server->Shutdown();
+    }
+    REQUIRE(true);
+}
+
+TEST_CASE("Batched RPCs resolve the same URLs as single message streams", "[batches]") {
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    std::thread server_runner([] { run_forever(grpc_test_address); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (auto num_urls : {0, 1, 10, 1000}) {
+        std::vector<std::string> urls = generate_localhost_echo_urls(num_urls);
+        // A batch size of 0 sends one item per batch
+        for (size_t batch_size : {0, 1, 7, 512}) {
+            URLFetcherClient fetcher(grpc_test_address);
+            auto keys = fetcher.request_fetches_in_batches(urls, batch_size);
+            REQUIRE(keys.size() == urls.size());
+            REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+            REQUIRE(std::adjacent_find(keys.begin(), keys.end()) == keys.end());
+            auto responses = fetcher.resolve_fetches_in_batches(keys, batch_size);
+            REQUIRE(responses.size() == urls.size());
+            for (int i = 0; i < urls.size(); ++i) {
+                REQUIRE(responses[i].curl_error() == 0);
+                REQUIRE(responses[i].body() == urls[i].substr(urls[i].rfind("/") + 1));
+            }
+        }
+        // Keys requested one way can be resolved the other way
+        URLFetcherClient fetcher(grpc_test_address);
+        auto single_responses = fetcher.resolve_fetches(fetcher.request_fetches_in_batches(urls));
+        auto batch_responses = fetcher.resolve_fetches_in_batches(fetcher.request_fetches(urls));
+        REQUIRE(single_responses.size() == urls.size());
+        REQUIRE(batch_responses.size() == urls.size());
+        for (int i = 0; i < urls.size(); ++i) {
+            REQUIRE(single_responses[i].body() == batch_responses[i].body());
+        }
+    }
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+    REQUIRE(true);
+}
+
+TEST_CASE("Bundled responses stay within the default gRPC message size limit", "[batches-large-bodies]") {
+    using urlfetcher::server::FakeFetchBackend;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    ServerOptions options;
+    // Bodies that do not fit into one bundle together, but each fit into the 4 MiB limit on their own
+    FakeFetchBackend small_bodies(900 * 1024);
+    FakeFetchBackend large_bodies(3584 * 1024);
+    options.fetch = [&](const std::string& url) {
+        return url.back() == 'L' ? large_bodies(url) : small_bodies(url);
+    };
+    std::thread server_runner([&options] { run_forever(grpc_test_address, options); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::vector<std::string> urls{"http://localhost/S", "http://localhost/L", "http://localhost/S", "http://localhost/L"};
+    URLFetcherClient fetcher(grpc_test_address);
+    auto keys = fetcher.request_fetches(urls);
+    // Let all fetches complete so that they are bundled instead of sent one by one as they complete
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto responses = fetcher.resolve_fetches_in_batches(keys);
+    REQUIRE(responses.size() == urls.size());
+    for (int i = 0; i < urls.size(); ++i) {
+        REQUIRE(responses[i].curl_error() == 0);
+        REQUIRE(responses[i].body().size() == (urls[i].back() == 'L' ? 3584 : 900) * 1024);
+    }
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+}
+
+TEST_CASE("FetchShard resolves fetches from the fake fetch backend without a network", "[fake-fetch-backend]") {
+    using urlfetcher::Response;
+    using urlfetcher::server::BodyHasher;
+    using urlfetcher::server::FakeFetchBackend;
+    using urlfetcher::server::FetchShard;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    for (size_t body_size : {0, 1, 1000}) {
+        FetchShard shard(0, 0, 4, FakeFetchBackend(body_size));
+        std::vector<std::string> urls = generate_localhost_echo_urls(100);
+        auto keys = shard.submit_fetches(urls);
+        REQUIRE(keys.size() == urls.size());
+        for (int i = 0; i < urls.size(); ++i) {
+            Response response;
+            REQUIRE(shard.resolve_fetch(keys[i], &response));
+            REQUIRE(response.curl_error() == 0);
+            std::string echo = urls[i].substr(urls[i].rfind("/") + 1);
+            if (body_size > 0) {
+                echo.resize(body_size, '.');
+            }
+            REQUIRE(response.body() == echo);
+            REQUIRE(response.body_digest() == BodyHasher::digest_of(echo));
+        }
+        REQUIRE(shard.num_completed_fetches() == 0);
+    }
+}
+
+TEST_CASE("Server records a traffic trace that the stand-in upstream reproduces", "[traffic-trace]") {
+    using urlfetcher::ReplayUpstream;
+    using urlfetcher::TraceRecord;
+    using urlfetcher::TrafficTraceReader;
+    using urlfetcher::replay_url;
+    using urlfetcher::server::FakeFetchBackend;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::server::fetch_URL;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    const std::string trace_path{"urlfetcher-test-trace.bin"};
+    ServerOptions options;
+    options.fetch = FakeFetchBackend(100, std::chrono::milliseconds(2));
+    options.trace_path = trace_path;
+    std::thread server_runner([&options] { run_forever(grpc_test_address, options); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::vector<std::string> urls = generate_localhost_echo_urls(50);
+    for (int stream = 0; stream < 2; ++stream) {
+        URLFetcherClient fetcher(grpc_test_address);
+        REQUIRE(fetcher.resolve_fetches(fetcher.request_fetches(urls)).size() == urls.size());
+    }
+    // The trace is complete once the service has been destroyed
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+
+    TrafficTraceReader trace(trace_path);
+    REQUIRE(trace.is_open());
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (trace.next(&record)) {
+        records.push_back(record);
+    }
+    REQUIRE(records.size() == 2 * urls.size());
+    std::map<uint64_t, std::vector<std::string> > session_urls;
+    for (const auto& record : records) {
+        REQUIRE(record.body_size() == 100);
+        REQUIRE(record.http_status() == 200);
+        REQUIRE(record.curl_error() == 0);
+        REQUIRE(record.latency_us() >= 2000);
+        session_urls[record.session()].push_back(record.url());
+    }
+    REQUIRE(session_urls.size() == 2);
+    for (auto& [session, recorded_urls] : session_urls) {
+        std::sort(recorded_urls.begin(), recorded_urls.end());
+        std::vector<std::string> sorted_urls{urls};
+        std::sort(sorted_urls.begin(), sorted_urls.end());
+        REQUIRE(recorded_urls == sorted_urls);
+    }
+
+    ReplayUpstream upstream(0, 10.0);
+    REQUIRE(upstream.is_listening());
+    records.front().set_http_status(404);
+    records.front().set_body_size(70'000);
+    records.back().set_http_status(0);
+    records.back().set_body_size(0);
+    for (const auto& record : records) {
+        auto response = fetch_URL(replay_url(record, upstream.address()));
+        if (record.http_status() == 0) {
+            REQUIRE(response.curl_error() != 0);
+        }
+        else {
+            REQUIRE(response.curl_error() == 0);
+            REQUIRE(response.http_status() == record.http_status());
+            REQUIRE(response.body().size() == record.body_size());
+        }
+    }
+    // Equal URLs get equal bodies
+    REQUIRE(fetch_URL(replay_url(records[1], upstream.address())).body()
+            == fetch_URL(replay_url(records[1], upstream.address())).body());
+    std::remove(trace_path.c_str());
+}
+
+
+TEST_CASE("Downloads to files carry the path, size and digest of the same body a regular fetch returns", "[download-to-file]") {
+    using urlfetcher::ReplayUpstream;
+    using urlfetcher::TraceRecord;
+    using urlfetcher::replay_url;
+    using urlfetcher::server::BodyHasher;
+    using urlfetcher::server::DownloadOptions;
+    using urlfetcher::server::FileSyncMode;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::server::download_URL;
+    using urlfetcher::server::fetch_URL;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    using urlfetcher::client::URLFetcherClient;
+    urlfetcher::server::logger->set_level(spdlog::level::err);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    char directory_template[]{"urlfetcher-test-downloads-XXXXXX"};
+    REQUIRE(mkdtemp(directory_template));
+    const std::string directory{directory_template};
+    auto read_file = [](const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    ReplayUpstream upstream;
+    REQUIRE(upstream.is_listening());
+    TraceRecord record;
+    record.set_url("http://localhost/download");
+    record.set_http_status(200);
+    // Not a multiple of the O_DIRECT alignment
+    record.set_body_size(3'000'001);
+    const std::string url = replay_url(record, upstream.address());
+    const std::string body = fetch_URL(url).body();
+    REQUIRE(body.size() == record.body_size());
+
+    for (auto sync : {FileSyncMode::none, FileSyncMode::sync_file_range, FileSyncMode::direct}) {
+        for (bool preallocate : {false, true}) {
+            const std::string path = directory + "/body";
+            auto response = download_URL(url, path, DownloadOptions{directory, preallocate, sync});
+            REQUIRE(response.curl_error() == 0);
+            REQUIRE(response.http_status() == 200);
+            REQUIRE(response.body().empty());
+            REQUIRE(response.file_path() == path);
+            REQUIRE(response.file_size() == body.size());
+            REQUIRE(response.body_digest() == BodyHasher::digest_of(body));
+            REQUIRE(read_file(path) == body);
+            REQUIRE(std::remove(path.c_str()) == 0);
+        }
+    }
+
+    // Failures report the errno of the call that failed
+    {
+        urlfetcher::server::FileSink missing_directory(directory + "/missing/body", FileSyncMode::none);
+        REQUIRE(!missing_directory.is_open());
+        REQUIRE(missing_directory.error() == ENOENT);
+        urlfetcher::server::FileSink full_device("/dev/full", FileSyncMode::none);
+        REQUIRE(full_device.is_open());
+        REQUIRE(!full_device.write(body.data(), 100));
+        REQUIRE(!full_device.close());
+        REQUIRE(full_device.error() == ENOSPC);
+    }
+
+    // A failed download leaves no file behind
+    record.set_http_status(0);
+    auto response = download_URL(replay_url(record, upstream.address()), directory + "/failed", DownloadOptions{directory});
+    REQUIRE(response.curl_error() != 0);
+    REQUIRE(response.file_path().empty());
+    REQUIRE(std::remove((directory + "/failed.part").c_str()) != 0);
+    REQUIRE(std::remove((directory + "/failed").c_str()) != 0);
+
+    ServerOptions options;
+    options.download.directory = directory;
+    std::thread server_runner([&options] { run_forever(grpc_test_address, options); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    {
+        record.set_http_status(200);
+        record.set_body_size(70'000);
+        std::vector<std::string> urls{url, replay_url(record, upstream.address())};
+        URLFetcherClient fetcher(grpc_test_address);
+        auto responses = fetcher.resolve_fetches_in_batches(fetcher.request_fetches(urls, true), 1, true);
+        REQUIRE(responses.size() == urls.size());
+        for (const auto& response : responses) {
+            REQUIRE(response.curl_error() == 0);
+            REQUIRE(response.body().empty());
+            REQUIRE(!response.body_omitted());
+            // Named after the run of the server and the key
+            REQUIRE(response.file_path().rfind(directory + "/", 0) == 0);
+            REQUIRE(response.file_path().find('-', directory.size()) != std::string::npos);
+            auto file_body = read_file(response.file_path());
+            REQUIRE(file_body.size() == response.file_size());
+            REQUIRE(BodyHasher::digest_of(file_body) == response.body_digest());
+            REQUIRE(std::remove(response.file_path().c_str()) == 0);
+        }
+        REQUIRE(responses[0].file_size() == body.size());
+        REQUIRE(responses[1].file_size() == 70'000);
+    }
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+    REQUIRE(std::remove(directory.c_str()) == 0);
+}
+
+
+TEST_CASE("LatencyHistogram percentiles stay within one sub-bucket of the recorded values", "[latency-histogram]") {
+    using urlfetcher::client::LatencyHistogram;
+    LatencyHistogram histogram;
+    REQUIRE(histogram.percentile(0.5) == 0);
+    for (uint64_t value = 1; value <= 100'000; ++value) {
+        histogram.record(value);
+    }
+    REQUIRE(histogram.count() == 100'000);
+    REQUIRE(histogram.max() == 100'000);
+    for (double p : {0.01, 0.5, 0.9, 0.99}) {
+        double exact = p * 100'000;
+        REQUIRE(histogram.percentile(p) >= exact);
+        REQUIRE(histogram.percentile(p) <= exact * 17 / 16);
+    }
+    REQUIRE(histogram.percentile(1.0) == 100'000);
+}
+
+TEST_CASE("BulkFetcher streams URLs with a bounded window and returns every result once, in input order", "[bulk-fetch]") {
+    using urlfetcher::FetchRecord;
+    using urlfetcher::client::BulkFetcher;
+    using urlfetcher::server::FakeFetchBackend;
+    using urlfetcher::server::ServerOptions;
+    using urlfetcher::server::run_forever;
+    using urlfetcher::server::shutdown_handler;
+    urlfetcher::server::logger->set_level(test_loglevel);
+    urlfetcher::client::logger->set_level(test_loglevel);
+    ServerOptions options;
+    options.fetch = FakeFetchBackend(10, std::chrono::microseconds(200));
+    std::thread server_runner([&options] { run_forever(grpc_test_address, options); });
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::vector<std::string> urls = generate_localhost_echo_urls(2000);
+    for (size_t window : {1, 16, 5000}) {
+        std::atomic<size_t> next_url{0};
+        size_t max_outstanding{0};
+        std::vector<FetchRecord> records;
+        BulkFetcher fetcher({grpc_test_address}, window);
+        auto summary = fetcher.run(
+                [&](std::string* url) {
+                    if (next_url == urls.size()) {
+                        return false;
+                    }
+                    *url = urls[next_url++];
+                    return true;
+                },
+                // Runs on a pipeline thread, so nothing is asserted here
+                [&](FetchRecord& record) {
+                    max_outstanding = std::max(max_outstanding, next_url - records.size());
+                    records.push_back(record);
+                });
+        // No more fetches are outstanding than the window allows,
+        // plus the next URL which may already take the place of the one being written
+        REQUIRE(max_outstanding <= window + 1);
+        REQUIRE(records.size() == urls.size());
+        for (size_t i = 0; i < records.size(); ++i) {
+            REQUIRE(records[i].index() == i);
+            REQUIRE(records[i].url() == urls[i]);
+            REQUIRE(records[i].response().curl_error() == 0);
+            REQUIRE(records[i].response().body().size() == 10);
+            REQUIRE(records[i].latency_us() >= 200);
+        }
+        REQUIRE(summary.num_resolved == urls.size());
+        REQUIRE(summary.num_failed == 0);
+        REQUIRE(summary.body_bytes == 10 * urls.size());
+        REQUIRE(summary.latencies_us.count() == urls.size());
+        REQUIRE(summary.latencies_us.percentile(0.5) >= 200);
+    }
+    shutdown_handler(SIGTERM);
+    server_runner.join();
+}